@@ -0,0 +1,174 @@
+/* Stand-ins for the Arduino core so tinytcl builds and runs on a Linux host.
+ * Pins are plain memory: writes are remembered, reads return whatever was
+ * last written or set with host_pin_set(), which also calls the pin's
+ * interrupt handler on a matching edge, and time is the monotonic clock. */
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define INPUT_PULLDOWN 3
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#ifndef HOST_PINS
+#define HOST_PINS 64
+#endif
+
+struct host_pin {
+    int mode;
+    int level;  /* digital level, read back by digitalRead() */
+    int analog; /* 0..1023, read back by analogRead() */
+    void (*isr)(void);
+    int edge; /* CHANGE, FALLING or RISING */
+};
+
+static struct host_pin host_pins[HOST_PINS];
+
+/* Drives an input pin from the outside, as a test fixture would, running
+ * its interrupt handler in place if the edge is one it is attached to */
+static inline void host_pin_set(int pin, int level) {
+    if (pin >= 0 && pin < HOST_PINS) {
+        struct host_pin *p = &host_pins[pin];
+        int old = p->level;
+        p->level = (level != LOW);
+        if (p->isr != NULL && p->level != old &&
+            (p->edge == CHANGE || (p->edge == RISING) == (p->level == HIGH))) {
+            p->isr();
+        }
+    }
+}
+
+static inline int digitalPinToInterrupt(int pin) {
+    return pin;
+}
+
+static inline void attachInterrupt(int irq, void (*isr)(void), int edge) {
+    if (irq >= 0 && irq < HOST_PINS) {
+        host_pins[irq].edge = edge;
+        host_pins[irq].isr = isr;
+    }
+}
+
+static inline void detachInterrupt(int irq) {
+    if (irq >= 0 && irq < HOST_PINS) {
+        host_pins[irq].isr = NULL;
+    }
+}
+
+static inline void host_pin_analog(int pin, int value) {
+    if (pin >= 0 && pin < HOST_PINS) {
+        host_pins[pin].analog = value;
+    }
+}
+
+static inline void pinMode(int pin, int mode) {
+    if (pin >= 0 && pin < HOST_PINS) {
+        host_pins[pin].mode = mode;
+        if (mode == INPUT_PULLUP) {
+            host_pins[pin].level = HIGH;
+        } else if (mode == INPUT_PULLDOWN) {
+            host_pins[pin].level = LOW;
+        }
+    }
+}
+
+static inline int digitalRead(int pin) {
+    return (pin >= 0 && pin < HOST_PINS ? host_pins[pin].level : LOW);
+}
+
+static inline void digitalWrite(int pin, int level) {
+    host_pin_set(pin, level);
+}
+
+static inline int analogRead(int pin) {
+    return (pin >= 0 && pin < HOST_PINS ? host_pins[pin].analog : 0);
+}
+
+static inline void analogWrite(int pin, int value) {
+    host_pin_analog(pin, value);
+    host_pin_set(pin, value != 0);
+}
+
+static inline unsigned long micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+static inline void delayMicroseconds(unsigned int us) {
+    usleep(us);
+}
+
+static inline void delay(unsigned long ms) {
+    usleep(ms * 1000);
+}
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t n) {
+        size_t i;
+        for (i = 0; i < n && write(buf[i]) == 1; i++) {
+        }
+        return i;
+    }
+    size_t write(const char *s, size_t n) { return write((const uint8_t *)s, n); }
+    size_t print(const char *s) { return write(s, strlen(s)); }
+    size_t println(const char *s) { return print(s) + print("\r\n"); }
+    size_t println() { return print("\r\n"); }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    size_t readBytes(char *buf, size_t n) {
+        size_t i;
+        int c;
+        for (i = 0; i < n && (c = read()) >= 0; i++) {
+            buf[i] = (char)c;
+        }
+        return i;
+    }
+};
+
+/* Serial is the process's stdin and stdout */
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    void end() {}
+    operator bool() { return true; }
+    size_t write(uint8_t c) { return fwrite(&c, 1, 1, stdout); }
+    size_t write(const uint8_t *buf, size_t n) { return fwrite(buf, 1, n, stdout); }
+    void flush() { fflush(stdout); }
+    int available() {
+        int n = 0;
+        return (ioctl(0, FIONREAD, &n) < 0 ? 0 : n);
+    }
+    int read() {
+        unsigned char c;
+        return (::read(0, &c, 1) == 1 ? c : -1);
+    }
+};
+
+static HardwareSerial Serial;
+
+#endif /* ARDUINO_H */
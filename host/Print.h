@@ -0,0 +1,2 @@
+/* On the host Print and Stream come with Arduino.h, as on most cores */
+#include "Arduino.h"
@@ -0,0 +1,65 @@
+/* SD card stand-in backed by the host file system, with paths taken relative
+ * to the directory given to SD.begin() (the current one by default) */
+#ifndef SD_H
+#define SD_H
+
+#include "Arduino.h"
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+
+class File : public Stream {
+    FILE *fp;
+public:
+    File(FILE *fp = NULL) : fp(fp) {}
+    operator bool() { return fp != NULL; }
+    size_t write(uint8_t c) { return (fp ? fwrite(&c, 1, 1, fp) : 0); }
+    size_t write(const uint8_t *buf, size_t n) { return (fp ? fwrite(buf, 1, n, fp) : 0); }
+    int read() { return (fp ? fgetc(fp) : -1); }
+    int read(void *buf, size_t n) { return (fp ? (int)fread(buf, 1, n, fp) : -1); }
+    int available() {
+        if (fp == NULL) {
+            return 0;
+        }
+        long at = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        long end = ftell(fp);
+        fseek(fp, at, SEEK_SET);
+        return (int)(end - at);
+    }
+    void flush() {
+        if (fp) {
+            fflush(fp);
+        }
+    }
+    void close() {
+        if (fp) {
+            fclose(fp);
+            fp = NULL;
+        }
+    }
+};
+
+class SDClass {
+    char root[256];
+public:
+    SDClass() { strcpy(root, "."); }
+    bool begin(const char *dir = ".") {
+        snprintf(root, sizeof(root), "%s", dir);
+        return true;
+    }
+    File open(const char *path, int mode = FILE_READ) {
+        char full[512];
+        snprintf(full, sizeof(full), "%s%s%s", root, (path[0] == '/' ? "" : "/"), path);
+        return File(fopen(full, mode == FILE_WRITE ? "a+" : "r"));
+    }
+    bool remove(const char *path) {
+        char full[512];
+        snprintf(full, sizeof(full), "%s%s%s", root, (path[0] == '/' ? "" : "/"), path);
+        return ::remove(full) == 0;
+    }
+};
+
+static SDClass SD;
+
+#endif /* SD_H */
@@ -0,0 +1,536 @@
+/* Benchmarks of the interpreter's core paths. Prints one tab-separated line
+ * per case: name, size, iterations, then nanoseconds, allocations and bytes
+ * allocated per iteration. Given the output of an earlier run, it adds that
+ * run's time per iteration and the ratio of the two, so a change can be
+ * checked against a stored baseline:
+ *
+ *     bench [-t seconds] [baseline.tsv]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "Arduino.h"
+#include "SD.h"
+#include "SPI.h"
+
+/* Every allocation the interpreter makes goes through these. They count per
+ * thread, so the pool cases show what the host itself allocates. */
+static thread_local unsigned long bench_allocs, bench_bytes;
+
+static void *bench_malloc(size_t n) {
+    bench_allocs++;
+    bench_bytes += n;
+    return malloc(n);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+    bench_allocs++;
+    bench_bytes += n;
+    return realloc(p, n);
+}
+
+#define malloc bench_malloc
+#define realloc bench_realloc
+#include "tinytcl.h"
+#undef malloc
+#undef realloc
+
+static double bench_mintime = 0.2;
+static double bench_t0;
+static unsigned long bench_allocs0, bench_bytes0;
+static double bench_elapsed;
+static unsigned long bench_nallocs, bench_nbytes;
+static int bench_running;
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Starts the measurement over, for cases that set something up first */
+static void bench_start() {
+    bench_running = 1;
+    bench_allocs0 = bench_allocs;
+    bench_bytes0 = bench_bytes;
+    bench_t0 = bench_now();
+}
+
+/* Ends the measurement, for cases that clean something up afterwards */
+static void bench_stop() {
+    if (bench_running) {
+        bench_elapsed = bench_now() - bench_t0;
+        bench_nallocs = bench_allocs - bench_allocs0;
+        bench_nbytes = bench_bytes - bench_bytes0;
+        bench_running = 0;
+    }
+}
+
+struct bench_base {
+    char name[64];
+    long size;
+    double ns;
+};
+
+static struct bench_base *bench_base;
+static int bench_nbase;
+
+static void bench_load(const char *path) {
+    char line[256];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct bench_base b;
+        long iters;
+        if (line[0] != '#' && sscanf(line, "%63s %ld %ld %lf", b.name, &b.size, &iters, &b.ns) == 4) {
+            bench_base = (struct bench_base *)realloc(bench_base, (bench_nbase + 1) * sizeof(b));
+            bench_base[bench_nbase++] = b;
+        }
+    }
+    fclose(f);
+}
+
+/* Runs fn with more and more iterations until it takes bench_mintime */
+static void bench(const char *name, long size, void (*fn)(long size, long iters)) {
+    long iters;
+    for (iters = 1;; iters *= 2) {
+        bench_start();
+        fn(size, iters);
+        bench_stop();
+        if (bench_elapsed >= bench_mintime || iters >= (1L << 40)) {
+            break;
+        }
+    }
+    double ns = bench_elapsed * 1e9 / iters;
+    printf("%s\t%ld\t%ld\t%.1f\t%.2f\t%.1f", name, size, iters, ns,
+           (double)bench_nallocs / iters, (double)bench_nbytes / iters);
+    for (int i = 0; i < bench_nbase; i++) {
+        if (strcmp(bench_base[i].name, name) == 0 && bench_base[i].size == size) {
+            printf("\t%.1f\t%.3f", bench_base[i].ns, ns / bench_base[i].ns);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void bench_eval(struct tcl *tcl, const char *s) {
+    if (tcl_eval(tcl, s, strlen(s) + 1) == TCL_ERROR) {
+        fprintf(stderr, "%s: %s\n", s, tcl_string(tcl->result));
+        exit(1);
+    }
+}
+
+/* A proc with size lines of ordinary commands, tokenized as a whole */
+static void bench_tokenize(long size, long iters) {
+    char *s = (char *)malloc(size * 80 + 32);
+    size_t n = 0;
+    long tokens = 0;
+    n += sprintf(s + n, "proc f {} {\n");
+    for (long i = 0; i < size; i++) {
+        n += sprintf(s + n, "    set name%ld [+ $x \"quoted $i text\"]; # a comment\n", i);
+    }
+    n += sprintf(s + n, "}\n");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        tcl_each(s, n + 1, 1) {
+            tokens++;
+        }
+    }
+    bench_stop();
+    free(s);
+    if (tokens == 0) {
+        abort();
+    }
+}
+
+/* The same commands outside any braces, so every word is tokenized */
+static void bench_tokenize_flat(long size, long iters) {
+    char *s = (char *)malloc(size * 80 + 32);
+    size_t n = 0;
+    long tokens = 0;
+    for (long i = 0; i < size; i++) {
+        n += sprintf(s + n, "set name%ld [+ $x \"quoted $i text\"]; # a comment\n", i);
+    }
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        tcl_each(s, n + 1, 1) {
+            tokens++;
+        }
+    }
+    bench_stop();
+    free(s);
+    if (tokens == 0) {
+        abort();
+    }
+}
+
+/* size commands of straight-line code at the top level */
+static void bench_eval_straight(long size, long iters) {
+    struct tcl tcl;
+    char *s = (char *)malloc(size * 48 + 1);
+    size_t n = 0;
+    tcl_init(&tcl);
+    for (long i = 0; i < size; i++) {
+        n += sprintf(s + n, "set a%ld %ld; set b $a%ld; set c [set b]\n", i % 10, i, i % 10);
+    }
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, s);
+    }
+    bench_stop();
+    free(s);
+    tcl_destroy(&tcl);
+}
+
+/* A call to a proc with size parameters that returns the first one */
+static void bench_proc_call(long size, long iters) {
+    struct tcl tcl;
+    char def[1024] = "proc f {", call[1024] = "f";
+    tcl_init(&tcl);
+    for (long i = 0; i < size; i++) {
+        sprintf(def + strlen(def), " p%ld", i);
+        sprintf(call + strlen(call), " %ld", i);
+    }
+    strcat(def, "} {return $p0}");
+    bench_eval(&tcl, def);
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, call);
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* A proc recursing size levels deep, one iteration per level */
+static void bench_proc_recurse(long size, long iters) {
+    struct tcl tcl;
+    char s[64];
+    tcl_init(&tcl);
+    bench_eval(&tcl, "proc rec {n} {if {<= $n 0} {return 0}; return [+ 1 [rec [- $n 1]]]}");
+    snprintf(s, sizeof(s), "rec %ld", size);
+    bench_start();
+    for (long k = 0; k < iters; k += size) {
+        bench_eval(&tcl, s);
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* A while loop counting to size with the math commands */
+static void bench_while_math(long size, long iters) {
+    struct tcl tcl;
+    char s[128];
+    tcl_init(&tcl);
+    snprintf(s, sizeof(s), "set i 0; set s 0; while {< $i %ld} {set s [+ $s [* $i 2]]; set i [+ $i 1]}", size);
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, s);
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* Building a list of size items one at a time */
+static void bench_list_append(long size, long iters) {
+    tcl_value_t *item = tcl_alloc("item", 4);
+    for (long k = 0; k < iters; k++) {
+        tcl_value_t *list = tcl_list_alloc();
+        for (long i = 0; i < size; i++) {
+            list = tcl_list_append(list, item);
+        }
+        tcl_free(list);
+    }
+    bench_stop();
+    tcl_free(item);
+}
+
+/* Indexing all over a list of size items, one index per iteration */
+static void bench_list_at(long size, long iters) {
+    tcl_value_t *list = tcl_list_alloc();
+    tcl_value_t *item = tcl_alloc("item", 4);
+    for (long i = 0; i < size; i++) {
+        list = tcl_list_append(list, item);
+    }
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        tcl_free(tcl_list_at(list, (int)(k * 7919 % size)));
+    }
+    bench_stop();
+    tcl_free(item);
+    tcl_free(list);
+}
+
+/* The same, on a list given as a string, which is parsed on first use */
+static void bench_list_parse(long size, long iters) {
+    tcl_value_t *s = tcl_alloc("", 0);
+    for (long i = 0; i < size; i++) {
+        s = tcl_append_string(s, "{an item} ", 10);
+    }
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        tcl_value_t *list = tcl_alloc(tcl_string(s), tcl_length(s));
+        tcl_free(tcl_list_at(list, (int)(size - 1)));
+        tcl_free(list);
+    }
+    bench_stop();
+    tcl_free(s);
+}
+
+/* Reading variables by name with size variables in the frame */
+static void bench_var_lookup(long size, long iters) {
+    struct tcl tcl;
+    char(*names)[32] = (char(*)[32])malloc(size * sizeof(*names));
+    tcl_init(&tcl);
+    for (long i = 0; i < size; i++) {
+        int n = sprintf(names[i], "variable%ld", i);
+        tcl_var_string(&tcl, names[i], n, tcl_alloc_int(i));
+    }
+    bench_start();
+    for (long k = 0, i = 0; k < iters; k++, i = (i + 7919) % size) {
+        tcl_var_string(&tcl, names[i], strlen(names[i]), NULL);
+    }
+    bench_stop();
+    free(names);
+    tcl_destroy(&tcl);
+}
+
+/* The same through a script, with the name in a $ substitution */
+static void bench_var_subst(long size, long iters) {
+    struct tcl tcl;
+    char name[64];
+    tcl_init(&tcl);
+    for (long i = 0; i < size; i++) {
+        int n = sprintf(name, "variable%ld", i);
+        tcl_var_string(&tcl, name, n, tcl_alloc_int(i));
+    }
+    sprintf(name, "set x $variable%ld", size / 2);
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, name);
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* Scheduling and cancelling a timer with size others pending, spread over
+ * every level of the wheel */
+static void bench_after(long size, long iters) {
+    struct tcl tcl;
+    unsigned long *ids = (unsigned long *)malloc(size * sizeof(*ids));
+    tcl_value_t *script = tcl_alloc("set x 1", 7);
+    tcl_init(&tcl);
+    for (long i = 0; i < size; i++) {
+        ids[i] = tcl_after_add(&tcl, 1000 + i * 7919 % 10000000, tcl_dup(script));
+    }
+    bench_start();
+    for (long k = 0, i = 0; k < iters; k++, i = (i + 7919) % size) {
+        tcl_after_cancel(&tcl, ids[i]);
+        ids[i] = tcl_after_add(&tcl, 1000 + k * 7919 % 10000000, tcl_dup(script));
+    }
+    bench_stop();
+    tcl_free(script);
+    free(ids);
+    tcl_destroy(&tcl);
+}
+
+/* A short line written to a file through a channel buffering size bytes,
+ * unbuffered for 0, one line per iteration */
+static void bench_puts(long size, long iters) {
+    struct tcl tcl;
+    char s[96];
+    tcl_init(&tcl);
+    bench_eval(&tcl, "set f [open /dev/null w]");
+    snprintf(s, sizeof(s), "fconfigure $f -buffering %s -buffersize %ld", (size > 0 ? "full" : "none"), (size > 0 ? size : 1));
+    bench_eval(&tcl, s);
+    bench_eval(&tcl, "proc p {f} {puts $f {a short line of text}}");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, "p $f");
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* Reading a file of size bytes, all of it at once */
+static void bench_read(long size, long iters) {
+    struct tcl tcl;
+    const char *path = "/tmp/tinytcl-bench.dat";
+    FILE *f = fopen(path, "w");
+    for (long i = 0; i < size; i++) {
+        fputc((int)(i * 7919 % 256), f);
+    }
+    fclose(f);
+    tcl_init(&tcl);
+    bench_eval(&tcl, "proc slurp {} {set f [open /tmp/tinytcl-bench.dat]; set data [read $f]; close $f; return $data}");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, "slurp");
+    }
+    bench_stop();
+    if (tcl_length(tcl.result) != size) {
+        abort();
+    }
+    tcl_destroy(&tcl);
+    remove(path);
+}
+
+/* Packing a list of size 16-bit samples and scanning it back */
+static void bench_binary(long size, long iters) {
+    struct tcl tcl;
+    char s[64];
+    tcl_init(&tcl);
+    bench_eval(&tcl, "set samples {}");
+    for (long i = 0; i < size; i++) {
+        snprintf(s, sizeof(s), "append samples { %ld}", i * 7919 % 65536 - 32768);
+        bench_eval(&tcl, s);
+    }
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, "binary scan [binary format s* $samples] s* back");
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* One reading of a pin on the stand-in HAL: with pin read, through a
+ * handle, or per reading of a pin sample taking size of them */
+static void bench_pin_read(long size, long iters) {
+    struct tcl tcl;
+    (void)size;
+    tcl_init(&tcl);
+    bench_eval(&tcl, "proc p {} {pin read -d 13}");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, "p");
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+static void bench_pin_handle(long size, long iters) {
+    struct tcl tcl;
+    (void)size;
+    tcl_init(&tcl);
+    bench_eval(&tcl, "pin handle -d 13; proc p {} {pin-d13}");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        bench_eval(&tcl, "p");
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+static void bench_pin_sample(long size, long iters) {
+    struct tcl tcl;
+    char s[64];
+    tcl_init(&tcl);
+    snprintf(s, sizeof(s), "proc p {} {pin sample -a 5 %ld}", size);
+    bench_eval(&tcl, s);
+    bench_start();
+    for (long k = 0; k < iters; k += size) {
+        bench_eval(&tcl, "p");
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* An edge injected on a watched pin, through the ring to its script */
+static void bench_pin_watch(long size, long iters) {
+    struct tcl tcl;
+    (void)size;
+    tcl_init(&tcl);
+    bench_eval(&tcl, "set n 0; pin watch 7 change {set n 1}");
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        host_pin_set(7, (int)(k & 1));
+        tcl_update(&tcl);
+    }
+    bench_stop();
+    tcl_destroy(&tcl);
+}
+
+/* The while_math loop as a script sent to a pool of size workers, one per
+ * iteration, each worker answering the host when it is done */
+static void bench_pool(long size, long iters) {
+    struct tcl shared;
+    const char *script = "set i 0; set s 0; while {< $i 1000} {set s [+ $s [* $i 2]]; set i [+ $i 1]}; send 0 $s";
+    tcl_init(&shared);
+    struct tcl_pool *pool = tcl_pool_new(&shared, (int)size);
+    bench_start();
+    for (long k = 0; k < iters; k++) {
+        tcl_pool_send(pool, (int)(k % size) + 1, script, strlen(script));
+    }
+    for (long k = 0; k < iters; k++) {
+        struct tcl_msg *m = tcl_pool_receive(pool, -1);
+        if (strncmp(m->str, "error", 5) == 0) {
+            fprintf(stderr, "%s\n", m->str);
+            exit(1);
+        }
+        free(m);
+    }
+    bench_stop();
+    tcl_pool_free(pool);
+    tcl_destroy(&shared);
+}
+
+int main(int argc, char **argv) {
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+        bench_mintime = atof(argv[i + 1]);
+        i += 2;
+    }
+    if (i < argc) {
+        bench_load(argv[i]);
+    }
+    printf("# name\tsize\titers\tns/iter\tallocs/iter\tbytes/iter%s\n",
+           bench_nbase > 0 ? "\tbase ns/iter\tratio" : "");
+    bench("tokenize", 2000, bench_tokenize);
+    bench("tokenize_flat", 2000, bench_tokenize_flat);
+    bench("eval_straight", 100, bench_eval_straight);
+    bench("proc_call", 0, bench_proc_call);
+    bench("proc_call", 4, bench_proc_call);
+    bench("proc_recurse", 10, bench_proc_recurse);
+    bench("proc_recurse", 1000, bench_proc_recurse);
+    bench("while_math", 1000, bench_while_math);
+    for (long n = 10; n <= 10000; n *= 10) {
+        bench("list_append", n, bench_list_append);
+    }
+    for (long n = 10; n <= 10000; n *= 10) {
+        bench("list_at", n, bench_list_at);
+    }
+    for (long n = 10; n <= 1000; n *= 10) {
+        bench("list_parse", n, bench_list_parse);
+    }
+    for (long n = 10; n <= 1000; n *= 10) {
+        bench("var_lookup", n, bench_var_lookup);
+    }
+    for (long n = 10; n <= 1000; n *= 10) {
+        bench("var_subst", n, bench_var_subst);
+    }
+    for (long n = 10; n <= 10000; n *= 10) {
+        bench("after", n, bench_after);
+    }
+    bench("puts", 0, bench_puts);
+    for (long n = 128; n <= 4096; n *= 32) {
+        bench("puts", n, bench_puts);
+    }
+    for (long n = 1024; n <= 1048576; n *= 32) {
+        bench("read", n, bench_read);
+    }
+    for (long n = 10; n <= 1000; n *= 10) {
+        bench("binary", n, bench_binary);
+    }
+    bench("pin_read", 0, bench_pin_read);
+    bench("pin_handle", 0, bench_pin_handle);
+    bench("pin_sample", 1000, bench_pin_sample);
+    bench("pin_watch", 0, bench_pin_watch);
+    for (long n = 1; n <= 4; n *= 2) {
+        bench("pool", n, bench_pool);
+    }
+    free(bench_base);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* Round trips through binary format and binary scan, for every field letter:
+ * each case is a script and the result it has to give. Prints the cases
+ * that fail and exits non-zero if there are any. */
+#include <stdlib.h>
+#include <stdio.h>
+#include "Arduino.h"
+#include "SD.h"
+#include "SPI.h"
+#include "tinytcl.h"
+
+struct test_case {
+    const char *script;
+    const char *want; /* NULL if the script has to fail */
+};
+
+static const struct test_case test_cases[] = {
+    /* Each number letter there and back, signed and unsigned */
+    {"binary scan [binary format c -5] c v; set v", "-5"},
+    {"binary scan [binary format c -5] cu v; set v", "251"},
+    {"binary scan [binary format s -2] s v; set v", "-2"},
+    {"binary scan [binary format S -2] Su v; set v", "65534"},
+    {"binary scan [binary format t 1234] t v; set v", "1234"},
+    {"binary scan [binary format i -100000] i v; set v", "-100000"},
+    {"binary scan [binary format I 4294967295] Iu v; set v", "4294967295"},
+    {"binary scan [binary format n 123456789] n v; set v", "123456789"},
+    {"binary scan [binary format w -5000000000] w v; set v", "-5000000000"},
+    {"binary scan [binary format W -1] Wu v; set v", "18446744073709551615"},
+    {"binary scan [binary format m 5000000000] m v; set v", "5000000000"},
+    {"binary scan [binary format r 1.5] r v; set v", "1.500000"},
+    {"binary scan [binary format R -0.25] R v; set v", "-0.250000"},
+    {"binary scan [binary format f 3] f v; set v", "3.000000"},
+    {"binary scan [binary format q 2.25] q v; set v", "2.250000"},
+    {"binary scan [binary format Q -1e10] Q v; set v", "-10000000000.000000"},
+    {"binary scan [binary format d 0.5] d v; set v", "0.500000"},
+    /* Byte order, little endian then big */
+    {"binary scan [binary format s 258] c* v; set v", "2 1"},
+    {"binary scan [binary format S 258] c* v; set v", "1 2"},
+    {"binary scan [binary format i 16909060] c* v; set v", "4 3 2 1"},
+    {"binary scan [binary format I 16909060] c* v; set v", "1 2 3 4"},
+    {"binary scan [binary format w 1] c* v; set v", "1 0 0 0 0 0 0 0"},
+    {"binary scan [binary format W 1] c* v; set v", "0 0 0 0 0 0 0 1"},
+    {"binary scan [binary format r 1] c* v; set v", "0 0 -128 63"},
+    {"binary scan [binary format R 1] c* v; set v", "63 -128 0 0"},
+    {"binary scan [binary format q 1] c* v; set v", "0 0 0 0 0 0 -16 63"},
+    {"binary scan [binary format Q 1] c* v; set v", "63 -16 0 0 0 0 0 0"},
+    /* Lists, with a count and with * */
+    {"binary scan [binary format s3 {1 -2 3}] s3 v; set v", "1 -2 3"},
+    {"binary scan [binary format I* {7 8}] I* v; set v", "7 8"},
+    {"binary scan [binary format d2 {1.5 -2}] d2 v; set v", "1.500000 -2.000000"},
+    {"binary format c3 {1 2}", NULL},
+    {"binary scan abc c0 v; set v", ""},
+    {"binary scan abc {x3 s*} v; set v", ""},
+    /* Strings, padded with NULs or spaces */
+    {"binary scan [binary format a5 hi] a5 v; binary scan $v c* v; set v", "104 105 0 0 0"},
+    {"binary scan [binary format A5 hi] A5 v; set v", "hi"},
+    {"binary scan [binary format a* hello] a3 v; set v", "hel"},
+    {"binary scan [binary format A* {hi  }] A* v; set v", "hi"},
+    /* Skipping, backing up and going to an offset */
+    {"binary scan [binary format {c x2 c} 1 2] {c x2 c} a b; set v \"$a $b\"", "1 2"},
+    {"binary scan [binary format {c3 X2 c} {1 2 3} 9] c* v; set v", "1 9 3"},
+    {"binary scan [binary format {c3 X2 x c} {1 2 3} 9] c* v; set v", "1 0 9"},
+    {"binary scan [binary format {@3 c} 4] {@3 c} v; set v", "4"},
+    {"binary scan [binary format {@3 c} 4] c* v; set v", "0 0 0 4"},
+    /* Scan stops when the bytes run out, however big the count */
+    {"binary scan [binary format s 1] {s s} a b", "1"},
+    {"binary scan abcdefgh w2305843009213693953 y", "0"},
+    {"binary scan abc a18446744073709551615 y", "0"},
+    {"binary scan abc {x18446744073709551615 c} y", "0"},
+    /* Counts no string could hold */
+    {"binary format x9223372036854775807", NULL},
+    {"binary format {c @9223372036854775807} 1", NULL},
+    /* Values that are not numbers at all */
+    {"binary format c abc", NULL},
+    {"binary format d 1.5x", NULL},
+    {"binary format s2 {1 two}", NULL},
+};
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+        const struct test_case *t = &test_cases[i];
+        struct tcl tcl;
+        tcl_init(&tcl);
+        tcl_result_t r = tcl_eval(&tcl, t->script, strlen(t->script) + 1);
+        const char *got = tcl_string(tcl.result);
+        if (t->want == NULL ? r != TCL_ERROR : r != TCL_OK || strcmp(got, t->want) != 0) {
+            printf("%s\n    gave %s%s, wanted %s\n", t->script, (r == TCL_ERROR ? "error " : ""), got,
+                   (t->want != NULL ? t->want : "an error"));
+            failed++;
+        }
+        tcl_destroy(&tcl);
+    }
+    printf("binary_test: %d of %lu failed\n", failed, (unsigned long)(sizeof(test_cases) / sizeof(test_cases[0])));
+    return failed != 0;
+}
@@ -0,0 +1,62 @@
+/* Scripts the interpreter once got wrong, each with the result it has to
+ * give. Prints the cases that fail and exits non-zero if there are any. */
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "Arduino.h"
+#include "SD.h"
+#include "SPI.h"
+#include "tinytcl.h"
+
+struct test_case {
+    const char *script;
+    const char *want; /* the error it has to fail with, if error is set */
+    int error;
+    size_t limit; /* tcl.heap.limit to run it under */
+};
+
+static const struct test_case test_cases[] = {
+    /* A proc called in place that redefines itself: the call releases the
+     * proc it started, not the one the command holds by then */
+    {"proc foo {} {proc foo {} {return 2}; return 1}\n"
+     "proc bar {} {set a [foo]; set b [foo]; set c [foo]; set v \"$a $b $c\"}\n"
+     "bar",
+     "1 2 2", 0, 0},
+    /* Readings of no pins at all are an empty string, NUL and all */
+    {"pin sample -d 13 0", "", 0, 0},
+    {"pin sample -a 0 0 -packed", "", 0, 0},
+    {"pin group read -d {}", "", 0, 0},
+#if ULONG_MAX > 0xffffffffUL
+    /* A timer id from 65536 reuses of its entry ago cancels nothing now,
+     * where unsigned long has room for the generation */
+    {"set first [after 100000 {set hit 1}]; after cancel $first\n"
+     "set i 0; while {$i < 65535} {after cancel [after 100000 {}]; set i [expr {$i + 1}]}\n"
+     "after 0 {set hit 2}; after cancel $first; update; set hit",
+     "2", 0, 0},
+#endif
+    /* A single allocation bigger than the whole memory limit fails the
+     * command instead of the allocator, also when a string doubles */
+    {"binary format x9000000000000000000", "memory limit exceeded", 1, 1 << 20},
+    {"set s x; while {1} {append s $s}", "memory limit exceeded", 1, 1 << 20},
+    {"set s x; while {1} {set s $s$s}", "memory limit exceeded", 1, 1 << 20},
+};
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+        const struct test_case *t = &test_cases[i];
+        struct tcl tcl;
+        tcl_init(&tcl);
+        tcl.heap.limit = t->limit;
+        tcl_result_t r = tcl_eval(&tcl, t->script, strlen(t->script) + 1);
+        const char *got = tcl_string(tcl.result);
+        if (r != (t->error ? TCL_ERROR : TCL_OK) || strcmp(got, t->want) != 0) {
+            printf("%s\n    gave %s%s, wanted %s%s\n", t->script, (r == TCL_ERROR ? "error " : ""), got,
+                   (t->error ? "error " : ""), t->want);
+            failed++;
+        }
+        tcl_destroy(&tcl);
+    }
+    printf("eval_test: %d of %lu failed\n", failed, (unsigned long)(sizeof(test_cases) / sizeof(test_cases[0])));
+    return failed != 0;
+}
@@ -0,0 +1,90 @@
+/* Differential test of the tokenizer's fast paths. Built once per TCL_SIMD
+ * variant (byte at a time, SWAR, SSE2, AVX2), it tokenizes the same random
+ * scripts and prints a hash of the tokens every 1000 scripts, so `make test`
+ * can compare each variant's output with the byte-at-a-time one. It also
+ * checks every tcl_skip() result against a plain scan itself:
+ *
+ *     skip_test [scripts]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include "tinytcl.h"
+
+static unsigned long test_seed = 1;
+
+static unsigned int test_rand(unsigned int n) {
+    test_seed = test_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(test_seed >> 33) % n;
+}
+
+/* Mostly the bytes the tokenizer cares about, with runs of plain letters
+ * long enough to take the strided paths */
+static size_t test_script(char *buf, size_t cap) {
+    static const char alpha[] = "ab $ {}[];\"\n\t\r\\x{{}}[[]]";
+    size_t n = 1 + test_rand((unsigned int)cap - 1);
+    for (size_t i = 0; i < n; i++) {
+        if (test_rand(16) == 0) {
+            size_t run = test_rand(80);
+            for (; run > 0 && i < n; run--, i++) {
+                buf[i] = 'a' + (char)test_rand(26);
+            }
+            if (i == n) {
+                break;
+            }
+        }
+        buf[i] = alpha[test_rand(sizeof(alpha) - 1)];
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* tcl_skip() may stop short of the first byte in set, never past it */
+static int test_skip(const char *s, size_t n, const char *set, int nset) {
+    size_t got = tcl_skip(s, n, set, nset), exact = 0;
+    while (exact < n && memchr(set, s[exact], nset) == NULL) {
+        exact++;
+    }
+    if (got > exact) {
+        fprintf(stderr, "tcl_skip: %lu past the first match at %lu of %lu\n",
+                (unsigned long)got, (unsigned long)exact, (unsigned long)n);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long scripts = (argc > 1 ? atol(argv[1]) : 80000);
+    char buf[640];
+    unsigned long h = 1469598103934665603UL;
+    int failed = 0;
+    for (long t = 0; t < scripts && !failed; t++) {
+        size_t n = test_script(buf, sizeof(buf) - 1);
+        for (size_t i = 0; i < n; i += 1 + test_rand(40)) {
+            failed |= test_skip(buf + i, n - i, tcl_word_ends[0], 12);
+            failed |= test_skip(buf + i, n - i, tcl_word_ends[1], 5);
+            failed |= test_skip(buf + i, n - i, "{}", 2);
+        }
+        /* Tokens over the script and its NUL, as the interpreter reads it */
+        const char *s = buf, *end = buf + n + 1, *from, *to;
+        int q = 0;
+        while (s < end) {
+            tcl_token tok = tcl_next(s, end - s, &from, &to, &q);
+            if (tok == TOK_ERROR) {
+                /* Start over past the bad byte, to cover the rest too */
+                h = (h ^ (unsigned long)((s - buf) * 131 + q)) * 1099511628211UL;
+                s++;
+                q = 0;
+                continue;
+            }
+            h = (h ^ (unsigned long)(tok * 131 + (from - buf) * 7 + (to - buf) * 3 + q)) * 1099511628211UL;
+            if (to <= s) {
+                break;
+            }
+            s = to;
+        }
+        if ((t + 1) % 1000 == 0) {
+            printf("%ld %016lx\n", t + 1, h);
+        }
+    }
+    return failed;
+}
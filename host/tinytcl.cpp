@@ -0,0 +1,45 @@
+/* Host build of the interpreter: runs the scripts named on the command line,
+ * or reads commands from stdin and prints each result, like the Serial REPL */
+#include "tinytcl.h"
+
+static size_t tcl_stdio_read(void *ctx, char *buf, size_t n) {
+    return fread(buf, 1, n, (FILE *)ctx);
+}
+
+int main(int argc, char **argv) {
+    struct tcl tcl;
+    struct tcl_reader reader;
+    tcl_result_t r = TCL_OK;
+    tcl_init(&tcl);
+    for (int i = 1; i < argc && r != TCL_ERROR; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        r = tcl_eval_stream(&tcl, tcl_stdio_read, f);
+        fclose(f);
+    }
+    if (argc > 1) {
+        if (r == TCL_ERROR) {
+            fprintf(stderr, "%s\n", tcl_string(tcl.result));
+        }
+        tcl_destroy(&tcl);
+        return (r == TCL_ERROR);
+    }
+    tcl_reader_init(&reader);
+    for (;;) {
+        ssize_t n = read(0, tcl_reader_reserve(&reader, TCL_CHUNK), TCL_CHUNK);
+        if (n <= 0) {
+            break;
+        }
+        if (tcl_reader_commit(&reader, n)) {
+            r = tcl_reader_eval(&tcl, &reader);
+            printf("%s%s\n", (r != TCL_ERROR ? "result> " : "?! "), tcl_string(tcl.result));
+            fflush(stdout);
+        }
+    }
+    tcl_reader_free(&reader);
+    tcl_destroy(&tcl);
+    return 0;
+}
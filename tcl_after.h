@@ -0,0 +1,425 @@
+#include "tinytcl.h"
+#include <Arduino.h>
+
+/* The event loop:
+ *
+ *   after ms              sleeps for ms
+ *   after ms script       runs script at the top level ms from now, and
+ *                         returns an id for after cancel
+ *   after idle script     runs script once the events due have run
+ *   after cancel id       forgets a script that has not run yet
+ *   update                runs whatever is due now
+ *   vwait name            runs events until the global variable name is
+ *                         set, even to the value it had
+ *
+ * Nothing runs by itself: the host calls tcl_update() now and then, e.g.
+ * from loop(), and can sleep for tcl_update_wait() milliseconds between
+ * calls. Scripts watching pins (see tcl_arduino.h) run there too.
+ *
+ * Timers sit in a hierarchical wheel of TCL_WHEEL_LEVELS levels of 64
+ * slots. The bottom level holds the next 64 ms a millisecond per slot,
+ * and each level above covers 64 times the span of the one below. A timer
+ * goes into the lowest level its delay fits, and is moved down a level
+ * whenever the wheel turns past its slot, so adding, cancelling and firing
+ * one take constant time. */
+
+#define TCL_WHEEL_LEVELS 4
+#define TCL_WHEEL_BITS 6
+#define TCL_WHEEL_SLOTS (1 << TCL_WHEEL_BITS)
+/* After the wheel's slots, two more lists: due now, and idle */
+#define TCL_WHEEL_READY (TCL_WHEEL_LEVELS * TCL_WHEEL_SLOTS)
+#define TCL_WHEEL_IDLE (TCL_WHEEL_READY + 1)
+
+/* Timers live in one growable array and link to each other by index, so
+ * a timer's id can be its index, with a generation count against reuse.
+ * The index takes the low 16 bits of the id, which caps how many can be
+ * pending at once, one short of 65536 so that no id is (unsigned long)-1.
+ * The generation takes the bits above, 32 of them where unsigned long is
+ * 64 bits wide. Where it is 32, as on most boards, only 16 are left, and an
+ * id is only unique until its entry has been reused 65536 times, after
+ * which a stale id can cancel the entry's current timer. */
+#define TCL_WHEEL_TIMERS 0xffff
+struct tcl_timer {
+    tcl_value_t *script; /* NULL while the entry is free */
+    unsigned long due;
+    unsigned long serial; /* order of scheduling */
+    int next, prev;       /* circular list of the same slot */
+    short list;           /* which list, -1 while free */
+    unsigned int gen;
+};
+
+struct tcl_wheel {
+    unsigned long now; /* time the wheel has turned up to */
+    unsigned long serial;
+    struct tcl_timer *timers;
+    int ntimers;
+    int free;    /* free entries, linked by next */
+    int pending; /* timers in the wheel's slots */
+    int head[TCL_WHEEL_IDLE + 1];
+    unsigned long long bits[TCL_WHEEL_LEVELS]; /* slots with a timer in them */
+};
+
+static void tcl_timer_link(struct tcl_wheel *w, int i, int list) {
+    struct tcl_timer *t = &w->timers[i];
+    int head = w->head[list];
+    t->list = list;
+    if (head < 0) {
+        t->next = t->prev = w->head[list] = i;
+    } else {
+        /* At the tail, so timers due together fire in order */
+        t->next = head;
+        t->prev = w->timers[head].prev;
+        w->timers[t->prev].next = i;
+        w->timers[head].prev = i;
+    }
+    if (list < TCL_WHEEL_READY) {
+        w->bits[list / TCL_WHEEL_SLOTS] |= 1ULL << (list % TCL_WHEEL_SLOTS);
+        w->pending++;
+    }
+}
+
+static void tcl_timer_unlink(struct tcl_wheel *w, int i) {
+    struct tcl_timer *t = &w->timers[i];
+    int list = t->list;
+    if (t->next == i) {
+        w->head[list] = -1;
+        if (list < TCL_WHEEL_READY) {
+            w->bits[list / TCL_WHEEL_SLOTS] &= ~(1ULL << (list % TCL_WHEEL_SLOTS));
+        }
+    } else {
+        w->timers[t->prev].next = t->next;
+        w->timers[t->next].prev = t->prev;
+        if (w->head[list] == i) {
+            w->head[list] = t->next;
+        }
+    }
+    if (list < TCL_WHEEL_READY) {
+        w->pending--;
+    }
+    t->list = -1;
+}
+
+/* Files timer i by how far off it is due */
+static void tcl_timer_place(struct tcl_wheel *w, int i) {
+    unsigned long due = w->timers[i].due;
+    unsigned long delta = due - w->now;
+    if ((long)delta <= 0) {
+        tcl_timer_link(w, i, TCL_WHEEL_READY);
+        return;
+    }
+    for (int level = 0; level < TCL_WHEEL_LEVELS; level++) {
+        int shift = level * TCL_WHEEL_BITS;
+        if (level == TCL_WHEEL_LEVELS - 1 && (delta >> shift) >= TCL_WHEEL_SLOTS) {
+            /* Further off than the wheel reaches: park it in the furthest
+             * slot, and it is placed again when the wheel gets there */
+            due = w->now + (((unsigned long)TCL_WHEEL_SLOTS << shift) - 1);
+        }
+        if ((delta >> shift) < TCL_WHEEL_SLOTS || level == TCL_WHEEL_LEVELS - 1) {
+            tcl_timer_link(w, i, level * TCL_WHEEL_SLOTS + ((due >> shift) & (TCL_WHEEL_SLOTS - 1)));
+            return;
+        }
+    }
+}
+
+/* Moves the timers of a slot to where they belong now */
+static void tcl_wheel_cascade(struct tcl_wheel *w, int list) {
+    while (w->head[list] >= 0) {
+        int i = w->head[list];
+        tcl_timer_unlink(w, i);
+        tcl_timer_place(w, i);
+    }
+}
+
+/* Turns the wheel to now, putting every timer due by then on the ready
+ * list. Stretches where the bottom level is empty are skipped. */
+static void tcl_wheel_advance(struct tcl_wheel *w, unsigned long now) {
+    if (w->pending == 0) {
+        w->now = now;
+        return;
+    }
+    while ((long)(now - w->now) > 0) {
+        if (w->bits[0] == 0) {
+            unsigned long end = w->now | (TCL_WHEEL_SLOTS - 1);
+            if ((long)(now - end) <= 0) {
+                w->now = now;
+                return;
+            }
+            w->now = end;
+        }
+        unsigned long t = ++w->now;
+        for (int level = 1; level < TCL_WHEEL_LEVELS; level++) {
+            int shift = level * TCL_WHEEL_BITS;
+            if ((t & ((1UL << shift) - 1)) != 0) {
+                break;
+            }
+            tcl_wheel_cascade(w, level * TCL_WHEEL_SLOTS + ((t >> shift) & (TCL_WHEEL_SLOTS - 1)));
+        }
+        int slot = t & (TCL_WHEEL_SLOTS - 1);
+        while (w->head[slot] >= 0) {
+            int i = w->head[slot];
+            tcl_timer_unlink(w, i);
+            tcl_timer_link(w, i, TCL_WHEEL_READY);
+        }
+    }
+}
+
+static struct tcl_wheel *tcl_wheel(struct tcl *tcl) {
+    if (tcl->wheel == NULL) {
+        tcl->wheel = (struct tcl_wheel *)tcl_calloc(1, sizeof(struct tcl_wheel));
+        tcl->wheel->now = millis();
+        tcl->wheel->free = -1;
+        for (int i = 0; i <= TCL_WHEEL_IDLE; i++) {
+            tcl->wheel->head[i] = -1;
+        }
+    }
+    return tcl->wheel;
+}
+
+static void tcl_after_free(struct tcl *tcl) {
+    struct tcl_wheel *w = tcl->wheel;
+    if (w == NULL) {
+        return;
+    }
+    for (int i = 0; i < w->ntimers; i++) {
+        if (w->timers[i].script != NULL) {
+            tcl_free(w->timers[i].script);
+        }
+    }
+    tcl_mfree(w->timers);
+    tcl_mfree(w);
+    tcl->wheel = NULL;
+}
+
+static unsigned long tcl_timer_id(struct tcl_wheel *w, int i) {
+    return (unsigned long)w->timers[i].gen << 16 | i;
+}
+
+/* Schedules script (taking it over) ms from now, or for idle time if ms is
+ * negative, and returns its id, or (unsigned long)-1 if TCL_WHEEL_TIMERS
+ * are pending already */
+static unsigned long tcl_after_add(struct tcl *tcl, long ms, tcl_value_t *script) {
+    struct tcl_wheel *w = tcl_wheel(tcl);
+    int i = w->free;
+    if (i < 0) {
+        if (w->ntimers == TCL_WHEEL_TIMERS) {
+            tcl_free(script);
+            return (unsigned long)-1;
+        }
+        int n = (w->ntimers == 0 ? 8 : 2 * w->ntimers);
+        n = (n > TCL_WHEEL_TIMERS ? TCL_WHEEL_TIMERS : n);
+        w->timers = (struct tcl_timer *)tcl_realloc(w->timers, n * sizeof(*w->timers));
+        memset(w->timers + w->ntimers, 0, (n - w->ntimers) * sizeof(*w->timers));
+        for (int k = n - 1; k >= w->ntimers; k--) {
+            w->timers[k].next = w->free;
+            w->timers[k].list = -1;
+            w->free = k;
+        }
+        w->ntimers = n;
+        i = w->free;
+    }
+    struct tcl_timer *t = &w->timers[i];
+    w->free = t->next;
+    tcl_wheel_advance(w, millis());
+    t->script = script;
+    t->serial = w->serial++;
+    if (ms < 0) {
+        tcl_timer_link(w, i, TCL_WHEEL_IDLE);
+    } else {
+        t->due = w->now + ms;
+        tcl_timer_place(w, i);
+    }
+    return tcl_timer_id(w, i);
+}
+
+static void tcl_after_release(struct tcl_wheel *w, int i) {
+    struct tcl_timer *t = &w->timers[i];
+    t->script = NULL;
+    t->gen++;
+    t->next = w->free;
+    w->free = i;
+}
+
+/* Cancels a timer by id, 0 if it had already run or never was */
+static int tcl_after_cancel(struct tcl *tcl, unsigned long id) {
+    struct tcl_wheel *w = tcl->wheel;
+    int i = (int)(id & 0xffff);
+    if (w == NULL || i >= w->ntimers || w->timers[i].list < 0 || tcl_timer_id(w, i) != id) {
+        return 0;
+    }
+    tcl_timer_unlink(w, i);
+    tcl_free(w->timers[i].script);
+    tcl_after_release(w, i);
+    return 1;
+}
+
+/* Evaluates script in the top level frame, as after scripts run there */
+static tcl_result_t tcl_eval_global(struct tcl *tcl, tcl_value_t *script) {
+    struct tcl_env *env = tcl->env;
+    while (tcl->env->parent != NULL) {
+        tcl->env = tcl->env->parent;
+    }
+    tcl_result_t r = tcl_eval(tcl, tcl_string(script), tcl_length(script) + 1);
+    tcl->env = env;
+    return r;
+}
+
+/* Runs the scripts on a list that were scheduled before serial */
+static tcl_result_t tcl_after_drain(struct tcl *tcl, int list, unsigned long serial) {
+    struct tcl_wheel *w = tcl->wheel;
+    int i;
+    while ((i = w->head[list]) >= 0 && (long)(w->timers[i].serial - serial) < 0) {
+        tcl_value_t *script = w->timers[i].script;
+        tcl_timer_unlink(w, i);
+        tcl_after_release(w, i);
+        tcl_result_t r = tcl_eval_global(tcl, script);
+        tcl_free(script);
+        if (r == TCL_ERROR) {
+            return r;
+        }
+    }
+    return TCL_OK;
+}
+
+static tcl_result_t tcl_watch_drain(struct tcl *tcl);
+static unsigned long tcl_watch_wait(struct tcl *tcl);
+
+/* Runs the scripts of pin edges that came in, the timers that are due,
+ * then the idle scripts, except any those schedule. If one fails, the rest
+ * wait for the next call and its error is returned. */
+tcl_result_t tcl_update(struct tcl *tcl) {
+    struct tcl_wheel *w = tcl->wheel;
+    if (tcl_watch_drain(tcl) == TCL_ERROR) {
+        return TCL_ERROR;
+    }
+    if (w == NULL) {
+        return TCL_OK;
+    }
+    tcl_wheel_advance(w, millis());
+    unsigned long serial = w->serial;
+    if (tcl_after_drain(tcl, TCL_WHEEL_READY, serial) == TCL_ERROR ||
+        tcl_after_drain(tcl, TCL_WHEEL_IDLE, serial) == TCL_ERROR) {
+        return TCL_ERROR;
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+static unsigned long tcl_wheel_wait(struct tcl_wheel *w) {
+    if (w == NULL) {
+        return (unsigned long)-1;
+    }
+    tcl_wheel_advance(w, millis());
+    if (w->head[TCL_WHEEL_READY] >= 0 || w->head[TCL_WHEEL_IDLE] >= 0) {
+        return 0;
+    }
+    if (w->pending == 0) {
+        return (unsigned long)-1;
+    }
+    int now = w->now & (TCL_WHEEL_SLOTS - 1);
+    for (int d = 1; d < TCL_WHEEL_SLOTS - now; d++) {
+        if (w->bits[0] & (1ULL << (now + d))) {
+            return d;
+        }
+    }
+    /* Nothing more in this turn of the bottom level: wake up for the next,
+     * where the levels above may have something moving down */
+    return TCL_WHEEL_SLOTS - now;
+}
+
+/* How many ms the host can sleep before calling tcl_update() again: 0 if
+ * something is ready, (unsigned long)-1 if nothing is scheduled at all and
+ * no pin is watched */
+unsigned long tcl_update_wait(struct tcl *tcl) {
+    unsigned long timers = tcl_wheel_wait(tcl->wheel), pins = tcl_watch_wait(tcl);
+    return (timers < pins ? timers : pins);
+}
+
+/* Sleeps until something may be due, ms at most */
+static void tcl_update_sleep(struct tcl *tcl, unsigned long ms) {
+    unsigned long wait = tcl_update_wait(tcl);
+    if (wait > 0) {
+        delay(wait < ms ? wait : ms);
+    }
+}
+
+static tcl_result_t tcl_cmd_after(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    const char *what = (argc > 1 ? tcl_string(argv[1]) : "");
+    char id[24];
+    if (strcmp(what, "cancel") == 0 && argc == 3) {
+        if (strncmp(tcl_string(argv[2]), "after#", 6) == 0) {
+            tcl_after_cancel(tcl, strtoul(tcl_string(argv[2]) + 6, NULL, 10));
+        }
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    long ms = -1;
+    if (strcmp(what, "idle") != 0) {
+        if (*what < '0' || *what > '9') {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("after ms|idle|cancel ?script?", 29));
+        }
+        ms = (long)tcl_int(argv[1]);
+    }
+    if (argc == 2 && ms >= 0) {
+        delay(ms);
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    if (argc < 3) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("after ms|idle|cancel ?script?", 29));
+    }
+    /* Like Tcl, the words after the time are joined into one script */
+    tcl_value_t *script = tcl_dup(argv[2]);
+    for (int i = 3; i < argc && script != NULL; i++) {
+        script = tcl_append_string(script, " ", 1);
+        script = (script != NULL ? tcl_append_string(script, tcl_string(argv[i]), tcl_length(argv[i])) : NULL);
+    }
+    if (script == NULL) {
+        return tcl_no_memory(tcl);
+    }
+    unsigned long n = tcl_after_add(tcl, ms, script);
+    if (n == (unsigned long)-1) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("too many timers", 15));
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc(id, snprintf(id, sizeof(id), "after#%lu", n)));
+}
+
+static tcl_result_t tcl_cmd_update(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc, (void)argv;
+    return tcl_update(tcl);
+}
+
+/* How often the global variable name was set, creating it if missing */
+static unsigned long tcl_var_writes(struct tcl *tcl, tcl_value_t *name) {
+    struct tcl_env *top = tcl->env;
+    while (top->parent != NULL) {
+        top = top->parent;
+    }
+    struct tcl_var *var = tcl_env_find(top, tcl_string(name), tcl_length(name));
+    if (var == NULL) {
+        var = tcl_env_var(top, tcl_string(name), tcl_length(name));
+    }
+    return var->writes;
+}
+
+static tcl_result_t tcl_cmd_vwait(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    /* Any set counts, even of the value it already had */
+    unsigned long writes = tcl_var_writes(tcl, argv[1]);
+    for (;;) {
+        if (tcl_update(tcl) == TCL_ERROR) {
+            return TCL_ERROR;
+        }
+        if (tcl_var_writes(tcl, argv[1]) != writes) {
+            break;
+        }
+        if (tcl_update_wait(tcl) == (unsigned long)-1) {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("vwait would wait forever", 24));
+        }
+        tcl_update_sleep(tcl, 100);
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+void tcl_init_after(struct tcl *tcl) {
+    tcl_register(tcl, "after", tcl_cmd_after, 0);
+    tcl_register(tcl, "update", tcl_cmd_update, 1);
+    tcl_register(tcl, "vwait", tcl_cmd_vwait, 2);
+}
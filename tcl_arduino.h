@@ -1,57 +1,460 @@
 #include "tinytcl.h"
 #include <Arduino.h>
 
-tcl_result_t tcl_cmd_pin(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)arg;
-    tcl_value_t *action = tcl_list_at(args, 1);
-    tcl_value_t *tnumber = tcl_list_at(args, 3);
-    int number = (int)tcl_num(tnumber);
-    tcl_value_t *value = tcl_list_at(args, 2);
-    tcl_value_t *result;
-    tcl_result_t r = TCL_OK;
-    // pin mode inputmode N
-    if (strcmp(tcl_string(action), "mode") == 0) {
-        int m;
-        if (strcmp(tcl_string(value), "-i") == 0) m = INPUT;
-        else if (strcmp(tcl_string(value), "-o") == 0) m = OUTPUT;
-        else if (strcmp(tcl_string(value), "-iu") == 0) m = INPUT_PULLUP;
+/* pin drives the GPIO pins:
+ *
+ *   pin mode -i|-o|-iu|-id pin
+ *   pin read -d|-a|-t pin
+ *   pin write -d|-a pin value          value is a number, high or low
+ *   pin sample -d|-a|-t pin count ?us? ?-packed?
+ *                                      count readings us microseconds apart,
+ *                                      as a list, or with -packed as 16-bit
+ *                                      little endian numbers (binary scan su*)
+ *   pin group mode|read|write flag pins ?values?
+ *                                      the same for a list of pins at once
+ *   pin handle -d|-a|-t pin            a command for the pin, named like
+ *                                      pin-d13: called with no arguments it
+ *                                      reads the pin, with a value writes it
+ *   pin watch pin rising|falling|change ?-debounce us? ?-coalesce? script
+ *                                      runs script at the top level on each
+ *                                      such edge of the pin
+ *   pin watch pin off
+ *   pin watch stats ?reset?            {events N dropped N debounced N
+ *                                      coalesced N run N latency N
+ *                                      maxlatency N}, latencies in us
+ *
+ * Flags are sorted out by their letter, not by a chain of string compares,
+ * and handles sort theirs out once, when they are made. */
+
+/* The letter of a flag like -d, if it is one of kinds, else 0 */
+static char tcl_pin_kind(tcl_value_t *flag, const char *kinds) {
+    const char *s = tcl_string(flag);
+    return (s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr(kinds, s[1]) != NULL ? s[1] : 0);
+}
+
+static int tcl_pin_mode(tcl_value_t *flag) {
+    const char *s = tcl_string(flag);
+    if (strcmp(s, "-o") == 0) return OUTPUT;
+    if (strcmp(s, "-iu") == 0) return INPUT_PULLUP;
 #ifdef INPUT_PULLDOWN
-        else if (strcmp(tcl_string(value), "-id") == 0) m = INPUT_PULLDOWN;
+    if (strcmp(s, "-id") == 0) return INPUT_PULLDOWN;
 #endif
-        else m = INPUT;
-        pinMode(number, m);
-    // pin read analog|digital N
-    } else if (strcmp(tcl_string(action), "read") == 0) {
-        int value;
-        if (strcmp(tcl_string(value), "-d") == 0) value = digitalRead(number);
-        else if (strcmp(tcl_string(value), "-a") == 0) value = analogRead(number);
+    return INPUT;
+}
+
+static int tcl_pin_level(tcl_value_t *v) {
+    const char *s = tcl_string(v);
+    if (strcmp(s, "high") == 0) return HIGH;
+    if (strcmp(s, "low") == 0) return LOW;
+    return (int)tcl_int(v);
+}
+
+static int tcl_pin_read(char kind, int number) {
+    switch (kind) {
+        case 'd': return digitalRead(number);
+        case 'a': return analogRead(number);
 #ifdef touchRead
-        else if (strcmp(tcl_string(value), "-t") == 0) value = touchRead(number);
+        case 't': return touchRead(number);
 #endif
-        char buf[16];
-        sprintf(buf, "%d", value);
-        result = tcl_alloc(buf, strlen(buf));
-    // pin write analog|digital N value
-    } else if (strcmp(tcl_string(action), "write") == 0) {
-        tcl_value_t *tval = tcl_list_at(args, 4);
-        int out = (int)tcl_num(tval);
-        if (strcmp(tcl_string(value), "-d") == 0) {
-            if (strcmp(tcl_string(tval), "high") == 0) out = HIGH;
-            else if (strcmp(tcl_string(tval), "low") == 0) out = LOW;
-            digitalWrite(number, out);
-        }
-        else if (strcmp(tcl_string(value), "-a") == 0) analogWrite(number, out);
-        tcl_free(tval);
+    }
+    return 0;
+}
+
+static void tcl_pin_write(char kind, int number, int value) {
+    if (kind == 'd') {
+        digitalWrite(number, value);
     } else {
-        result = tcl_alloc("pin what?", 9);
-        r = TCL_ERROR;
+        analogWrite(number, value);
+    }
+}
+
+/* Appends a reading to a list being built as text */
+static tcl_value_t *tcl_pin_append(tcl_value_t *list, int level) {
+    char buf[24];
+    size_t n = 0;
+    if (list->len > 0) {
+        buf[n++] = ' ';
+    }
+    n += tcl_format_int(buf + n, level);
+    return tcl_append_string(list, buf, n);
+}
+
+static tcl_result_t tcl_pin_sample(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    char kind = tcl_pin_kind(argv[2], "dat");
+    long count = (argc > 4 ? (long)tcl_int(argv[4]) : -1);
+    if (kind == 0 || count < 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin sample -d|-a|-t pin count ?us? ?-packed?", 44));
+    }
+    int number = (int)tcl_int(argv[3]);
+    int packed = (strcmp(tcl_string(argv[argc - 1]), "-packed") == 0);
+    unsigned long interval = (argc - packed > 5 ? (unsigned long)tcl_int(argv[5]) : 0);
+    tcl_value_t *out = tcl_reserve(NULL, count * (packed ? 2 : 5));
+    if (out == NULL) {
+        return tcl_no_memory(tcl);
+    }
+    unsigned long due = micros();
+    for (long i = 0; i < count; i++) {
+        if (i > 0 && interval > 0) {
+            /* Wait for the next reading rather than sleep past it */
+            due += interval;
+            while ((long)(micros() - due) < 0) {
+            }
+        }
+        int level = tcl_pin_read(kind, number);
+        if (packed) {
+            tcl_bin_put((unsigned char *)out->str + out->len, (unsigned long long)level, 2, 0);
+            tcl_finalize(out, 2);
+        } else {
+            out = tcl_pin_append(out, level);
+        }
+    }
+    /* Terminated even when count is 0 */
+    tcl_finalize(out, 0);
+    return tcl_result(tcl, TCL_OK, out);
+}
+
+static tcl_result_t tcl_pin_group(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    const char *action = tcl_string(argv[2]);
+    struct tcl_list *pins = tcl_to_list(argv[4]);
+    if (strcmp(action, "mode") == 0) {
+        int mode = tcl_pin_mode(argv[3]);
+        for (int i = 0; i < pins->len; i++) {
+            pinMode((int)tcl_int(pins->items[i]), mode);
+        }
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    char kind = tcl_pin_kind(argv[3], strcmp(action, "read") == 0 ? "dat" : "da");
+    if (kind != 0 && strcmp(action, "read") == 0) {
+        tcl_value_t *out = tcl_reserve(NULL, pins->len * 2);
+        for (int i = 0; i < pins->len && out != NULL; i++) {
+            out = tcl_pin_append(out, tcl_pin_read(kind, (int)tcl_int(pins->items[i])));
+        }
+        if (out == NULL) {
+            return tcl_no_memory(tcl);
+        }
+        tcl_finalize(out, 0);
+        return tcl_result(tcl, TCL_OK, out);
+    }
+    if (kind != 0 && strcmp(action, "write") == 0 && argc > 5) {
+        struct tcl_list *values = tcl_to_list(argv[5]);
+        if (values->len != pins->len) {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("one value per pin", 17));
+        }
+        for (int i = 0; i < pins->len; i++) {
+            tcl_pin_write(kind, (int)tcl_int(pins->items[i]), tcl_pin_level(values->items[i]));
+        }
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin group mode|read|write flag pins ?values?", 44));
+}
+
+/* What a pin handle knows, set once when it is made */
+struct tcl_pin {
+    char kind;
+    int number;
+};
+
+static tcl_result_t tcl_cmd_pin_handle(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    struct tcl_pin *pin = (struct tcl_pin *)arg;
+    if (argc == 1) {
+        return tcl_result(tcl, TCL_OK, tcl_alloc_int(tcl_pin_read(pin->kind, pin->number)));
+    }
+    if (argc == 2 && pin->kind != 't') {
+        tcl_pin_write(pin->kind, pin->number, tcl_pin_level(argv[1]));
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin handle takes ?value?", 24));
+}
+
+/* Handles are named after their pin, so asking again gives the same one */
+static tcl_result_t tcl_pin_handle(struct tcl *tcl, tcl_value_t **argv) {
+    char kind = tcl_pin_kind(argv[2], "dat");
+    if (kind == 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin handle -d|-a|-t pin", 23));
+    }
+    struct tcl_pin *pin = (struct tcl_pin *)tcl_malloc(sizeof(*pin));
+    char name[32];
+    pin->kind = kind;
+    pin->number = (int)tcl_int(argv[3]);
+    size_t n = snprintf(name, sizeof(name), "pin-%c%d", kind, pin->number);
+    tcl_register(tcl, name, tcl_cmd_pin_handle, 0, pin);
+    return tcl_result(tcl, TCL_OK, tcl_alloc(name, n));
+}
+
+/* Watched pins. The interrupt of each only notes the edge, as a few bytes
+ * in a ring it alone writes to, and the scripts run later, when
+ * tcl_update() drains the ring, which only the interpreter that set the
+ * watches does. An edge within -debounce us of the last one taken is
+ * dropped, and with -coalesce one still waiting in the ring stands for any
+ * that follow it. Edges that find the ring full are dropped and counted. */
+#define TCL_WATCH 8
+
+#ifdef IRAM_ATTR
+#define TCL_ISR_ATTR IRAM_ATTR
+#else
+#define TCL_ISR_ATTR
+#endif
+
+struct tcl_watch {
+    tcl_value_t *script; /* NULL while the slot is free */
+    int pin;
+    unsigned long debounce;
+    unsigned long last; /* time of the last edge taken */
+    unsigned char gen;  /* tells its edges from a former watch's */
+    char coalesce;
+    volatile char pending; /* an edge of this watch is in the ring */
+};
+
+struct tcl_edge {
+    unsigned char slot;
+    unsigned char gen;
+    unsigned long t;
+};
+
+/* Written by the interrupts, read by the interpreter */
+struct tcl_watch_stats {
+    unsigned long events;
+    unsigned long dropped;
+    unsigned long debounced;
+    unsigned long coalesced;
+};
+
+static struct tcl_watch tcl_watches[TCL_WATCH];
+static struct tcl *tcl_watcher;
+static struct tcl_edge tcl_edges[TCL_WATCH_RING];
+/* Counts of edges put in and taken out, wrapping around */
+static unsigned char tcl_edge_head, tcl_edge_tail;
+static volatile struct tcl_watch_stats tcl_watch_stats;
+static unsigned long tcl_watch_run, tcl_watch_latency, tcl_watch_maxlatency;
+
+static TCL_ISR_ATTR void tcl_watch_edge(int slot) {
+    struct tcl_watch *w = &tcl_watches[slot];
+    unsigned long t = micros();
+    if (w->debounce > 0 && t - w->last < w->debounce) {
+        tcl_watch_stats.debounced++;
+        return;
+    }
+    w->last = t;
+    if (w->coalesce && w->pending) {
+        tcl_watch_stats.coalesced++;
+        return;
     }
-    tcl_free(action);
-    tcl_free(tnumber);
-    tcl_free(value);
-    return tcl_result(tcl, r, result ? result : tcl_alloc("", 0));
+    unsigned char head = tcl_edge_head;
+    if ((unsigned char)(head - __atomic_load_n(&tcl_edge_tail, __ATOMIC_ACQUIRE)) == TCL_WATCH_RING) {
+        tcl_watch_stats.dropped++;
+        return;
+    }
+    struct tcl_edge *e = &tcl_edges[head & (TCL_WATCH_RING - 1)];
+    e->slot = (unsigned char)slot;
+    e->gen = w->gen;
+    e->t = t;
+    w->pending = 1;
+    tcl_watch_stats.events++;
+    __atomic_store_n(&tcl_edge_head, (unsigned char)(head + 1), __ATOMIC_RELEASE);
+}
+
+/* attachInterrupt() handlers take no argument, so each slot has its own */
+#define TCL_WATCH_ISR(n) \
+    static TCL_ISR_ATTR void tcl_watch_isr##n() { tcl_watch_edge(n); }
+TCL_WATCH_ISR(0)
+TCL_WATCH_ISR(1)
+TCL_WATCH_ISR(2)
+TCL_WATCH_ISR(3)
+TCL_WATCH_ISR(4)
+TCL_WATCH_ISR(5)
+TCL_WATCH_ISR(6)
+TCL_WATCH_ISR(7)
+
+static void (*const tcl_watch_isrs[TCL_WATCH])() = {
+    tcl_watch_isr0, tcl_watch_isr1, tcl_watch_isr2, tcl_watch_isr3,
+    tcl_watch_isr4, tcl_watch_isr5, tcl_watch_isr6, tcl_watch_isr7,
+};
+
+static void tcl_watch_off(int slot) {
+    struct tcl_watch *w = &tcl_watches[slot];
+    detachInterrupt(digitalPinToInterrupt(w->pin));
+    tcl_free(w->script);
+    w->script = NULL;
+    w->gen++;
+}
+
+static void tcl_watch_free(struct tcl *tcl) {
+    if (tcl_watcher != tcl) {
+        return;
+    }
+    for (int i = 0; i < TCL_WATCH; i++) {
+        if (tcl_watches[i].script != NULL) {
+            tcl_watch_off(i);
+        }
+    }
+    tcl_edge_tail = __atomic_load_n(&tcl_edge_head, __ATOMIC_ACQUIRE);
+    tcl_watcher = NULL;
+}
+
+/* Runs the scripts of the edges in the ring, see tcl_update() */
+static tcl_result_t tcl_watch_drain(struct tcl *tcl) {
+    if (tcl_watcher != tcl) {
+        return TCL_OK;
+    }
+    unsigned char tail = tcl_edge_tail;
+    while (tail != __atomic_load_n(&tcl_edge_head, __ATOMIC_ACQUIRE)) {
+        struct tcl_edge e = tcl_edges[tail & (TCL_WATCH_RING - 1)];
+        struct tcl_watch *w = &tcl_watches[e.slot];
+        /* Cleared before the edge leaves the ring, so one coming in now is
+         * queued rather than folded into this one */
+        w->pending = 0;
+        __atomic_store_n(&tcl_edge_tail, ++tail, __ATOMIC_RELEASE);
+        if (w->script == NULL || w->gen != e.gen) {
+            continue;
+        }
+        tcl_watch_latency = micros() - e.t;
+        if (tcl_watch_latency > tcl_watch_maxlatency) {
+            tcl_watch_maxlatency = tcl_watch_latency;
+        }
+        tcl_watch_run++;
+        /* The script may turn its own watch off */
+        tcl_value_t *script = tcl_dup(w->script);
+        tcl_result_t r = tcl_eval_global(tcl, script);
+        tcl_free(script);
+        if (r == TCL_ERROR) {
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+/* 0 if edges are waiting, 1 ms while pins are watched, else forever */
+static unsigned long tcl_watch_wait(struct tcl *tcl) {
+    if (tcl_watcher != tcl) {
+        return (unsigned long)-1;
+    }
+    return (tcl_edge_tail != __atomic_load_n(&tcl_edge_head, __ATOMIC_ACQUIRE) ? 0 : 1);
+}
+
+static tcl_result_t tcl_watch_report(struct tcl *tcl, int reset) {
+    const char *names[] = {"events", "dropped", "debounced", "coalesced", "run", "latency", "maxlatency"};
+    unsigned long values[] = {
+        tcl_watch_stats.events, tcl_watch_stats.dropped, tcl_watch_stats.debounced,
+        tcl_watch_stats.coalesced, tcl_watch_run, tcl_watch_latency, tcl_watch_maxlatency,
+    };
+    if (reset) {
+        memset((void *)&tcl_watch_stats, 0, sizeof(tcl_watch_stats));
+        tcl_watch_run = tcl_watch_latency = tcl_watch_maxlatency = 0;
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    tcl_value_t *info = tcl_list_alloc();
+    for (int i = 0; i < 7; i++) {
+        tcl_value_t *name = tcl_alloc(names[i], strlen(names[i]));
+        tcl_value_t *value = tcl_alloc_int(values[i]);
+        info = tcl_list_append(tcl_list_append(info, name), value);
+        tcl_free(name);
+        tcl_free(value);
+    }
+    return tcl_result(tcl, TCL_OK, info);
+}
+
+static tcl_result_t tcl_pin_watch(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    static const char *usage = "pin watch pin rising|falling|change ?-debounce us? ?-coalesce? script|off";
+    if (argc >= 3 && strcmp(tcl_string(argv[2]), "stats") == 0) {
+        return tcl_watch_report(tcl, argc > 3 && strcmp(tcl_string(argv[3]), "reset") == 0);
+    }
+    if (argc < 4) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc(usage, strlen(usage)));
+    }
+    if (tcl_watcher != NULL && tcl_watcher != tcl) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("pins are watched by another interpreter", 39));
+    }
+    /* The pin's watch, if it has one, is only replaced once the rest of
+     * the command turns out right */
+    int pin = (int)tcl_int(argv[2]), slot = -1, old = -1, used = 0;
+    for (int i = 0; i < TCL_WATCH; i++) {
+        if (tcl_watches[i].script != NULL && tcl_watches[i].pin == pin) {
+            old = i;
+        } else if (tcl_watches[i].script != NULL) {
+            used++;
+        } else if (slot < 0) {
+            slot = i;
+        }
+    }
+    const char *edge = tcl_string(argv[3]);
+    if (strcmp(edge, "off") == 0) {
+        if (old >= 0) {
+            tcl_watch_off(old);
+        }
+        if (used == 0) {
+            /* Nothing left to watch, another interpreter may have the pins */
+            tcl_watch_free(tcl);
+        }
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    int mode = (strcmp(edge, "rising") == 0 ? RISING : strcmp(edge, "falling") == 0 ? FALLING :
+                strcmp(edge, "change") == 0 ? CHANGE : -1);
+    unsigned long debounce = 0;
+    char coalesce = 0;
+    int i = 4;
+    for (; i < argc - 1; i++) {
+        if (strcmp(tcl_string(argv[i]), "-coalesce") == 0) {
+            coalesce = 1;
+        } else if (strcmp(tcl_string(argv[i]), "-debounce") == 0 && i + 2 < argc) {
+            debounce = (unsigned long)tcl_int(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (mode < 0 || i != argc - 1) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc(usage, strlen(usage)));
+    }
+    if (old >= 0) {
+        tcl_watch_off(old);
+        slot = old;
+    } else if (slot < 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("too many pins watched", 21));
+    }
+    struct tcl_watch *w = &tcl_watches[slot];
+    w->pin = pin;
+    w->debounce = debounce;
+    w->last = micros() - debounce;
+    w->coalesce = coalesce;
+    w->pending = 0;
+    w->script = tcl_dup(argv[argc - 1]);
+    tcl_watcher = tcl;
+    attachInterrupt(digitalPinToInterrupt(pin), tcl_watch_isrs[slot], mode);
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+tcl_result_t tcl_cmd_pin(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    if (argc > 1 && strcmp(tcl_string(argv[1]), "watch") == 0) {
+        return tcl_pin_watch(tcl, argc, argv);
+    }
+    if (argc < 4) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin what?", 9));
+    }
+    const char *action = tcl_string(argv[1]);
+    char kind;
+    if (strcmp(action, "read") == 0 && (kind = tcl_pin_kind(argv[2], "dat")) != 0) {
+        return tcl_result(tcl, TCL_OK, tcl_alloc_int(tcl_pin_read(kind, (int)tcl_int(argv[3]))));
+    }
+    if (strcmp(action, "write") == 0 && argc > 4 && (kind = tcl_pin_kind(argv[2], "da")) != 0) {
+        tcl_pin_write(kind, (int)tcl_int(argv[3]), tcl_pin_level(argv[4]));
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    if (strcmp(action, "mode") == 0) {
+        pinMode((int)tcl_int(argv[3]), tcl_pin_mode(argv[2]));
+        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    }
+    if (strcmp(action, "sample") == 0) {
+        return tcl_pin_sample(tcl, argc, argv);
+    }
+    if (strcmp(action, "group") == 0 && argc > 4) {
+        return tcl_pin_group(tcl, argc, argv);
+    }
+    if (strcmp(action, "handle") == 0) {
+        return tcl_pin_handle(tcl, argv);
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("pin what?", 9));
 }
 
 void tcl_init_arduino(struct tcl *tcl) {
     tcl_register(tcl, "pin", tcl_cmd_pin, 0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,338 @@
+#include "tinytcl.h"
+#include <limits.h>
+#include <stdint.h>
+
+/* binary packs numbers into bytes and unpacks them, for compact records on
+ * the SD card or over SPI:
+ *
+ *   binary format spec ?value ...?    the bytes, one value per field
+ *   binary scan bytes spec ?var ...?  sets one var per field, returns how
+ *                                     many were set before the bytes ran out
+ *
+ * spec is a run of fields, each a letter, then for scan a u to read the
+ * integer unsigned, then a count or * for all there is:
+ *
+ *   a A     a string of count bytes, padded with NULs (a) or spaces (A)
+ *   c       8-bit integers
+ *   s S t   16-bit integers: little endian, big endian, native
+ *   i I n   32-bit integers
+ *   w W m   64-bit integers
+ *   r R f   floats
+ *   q Q d   doubles
+ *   x X @   a NUL byte (skip one in scan), back up a byte, go to offset count
+ *
+ * A number field with a count, even 1, takes or gives a list of that many
+ * numbers, one without takes or gives a single number. Both run over the
+ * bytes in place: format fills one value as it goes, and scan writes each
+ * list straight into the string of its value. */
+
+struct tcl_binfield {
+    char type;
+    char u;
+    long count; /* -1 none given, -2 for * */
+};
+
+/* Bytes of a number field, 0 for the rest */
+static int tcl_bin_size(char type) {
+    switch (type) {
+        case 'c': return 1;
+        case 's': case 'S': case 't': return 2;
+        case 'i': case 'I': case 'n': case 'r': case 'R': case 'f': return 4;
+        case 'w': case 'W': case 'm': case 'q': case 'Q': case 'd': return 8;
+    }
+    return 0;
+}
+
+static int tcl_bin_big(char type) {
+    const unsigned short one = 1;
+    if (type == 't' || type == 'n' || type == 'm' || type == 'f' || type == 'd') {
+        return *(const unsigned char *)&one == 0;
+    }
+    return type >= 'A' && type <= 'Z';
+}
+
+static int tcl_bin_float(char type) {
+    return strchr("rRfqQd", type) != NULL;
+}
+
+/* Reads the field at p, returning where the next one starts, or NULL if
+ * the letter means nothing */
+static const char *tcl_bin_field(const char *p, struct tcl_binfield *f) {
+    f->type = *p++;
+    if (tcl_bin_size(f->type) == 0 && strchr("aAxX@", f->type) == NULL) {
+        return NULL;
+    }
+    f->u = (*p == 'u');
+    p += f->u;
+    f->count = -1;
+    if (*p == '*') {
+        f->count = -2;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        f->count = strtol(p, (char **)&p, 10);
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+static void tcl_bin_put(unsigned char *p, unsigned long long u, int size, int big) {
+    for (int i = 0; i < size; i++) {
+        p[big ? size - 1 - i : i] = (unsigned char)(u >> (8 * i));
+    }
+}
+
+static unsigned long long tcl_bin_get(const unsigned char *p, int size, int big) {
+    unsigned long long u = 0;
+    for (int i = 0; i < size; i++) {
+        u |= (unsigned long long)p[big ? size - 1 - i : i] << (8 * i);
+    }
+    return u;
+}
+
+/* Sets *u to the bits of one number as they are to be stored, returns 0 if
+ * v is not a number at all, which tcl_int() would take as 0 */
+static int tcl_bin_bits(char type, tcl_value_t *v, unsigned long long *u) {
+    if (type == 'r' || type == 'R' || type == 'f') {
+        float x = (float)tcl_double(v);
+        uint32_t bits;
+        memcpy(&bits, &x, 4);
+        *u = bits;
+    } else if (tcl_bin_float(type)) {
+        double x = tcl_double(v);
+        memcpy(u, &x, 8);
+    } else {
+        *u = (unsigned long long)tcl_int(v);
+    }
+    if (v->type == TCL_INT || v->str == NULL) {
+        return 1;
+    }
+    char *end;
+    strtod(v->str, &end);
+    return end != v->str && end == v->str + v->len;
+}
+
+/* Where n bytes at pos go in out, growing it with NULs to get there. NULL,
+ * with out released, if there is no memory for that, or the string would
+ * be longer than tcl_length() can tell, as a huge x or @ count asks. */
+static unsigned char *tcl_bin_at(tcl_value_t **out, size_t pos, size_t n) {
+    size_t len = (*out)->len;
+    if (pos > INT_MAX || n > INT_MAX - pos) {
+        tcl_free(*out);
+        *out = NULL;
+        return NULL;
+    }
+    if (pos + n > len) {
+        if ((*out = tcl_reserve(*out, pos + n - len)) == NULL) {
+            return NULL;
+        }
+        memset((*out)->str + len, 0, pos + n - len);
+        tcl_finalize(*out, pos + n - len);
+    }
+    return (unsigned char *)(*out)->str + pos;
+}
+
+static tcl_result_t tcl_bin_format(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    const char *p = tcl_string(argv[2]);
+    tcl_value_t *out = tcl_alloc("", 0);
+    size_t pos = 0;
+    int k = 3;
+    struct tcl_binfield f;
+    while (*p != '\0') {
+        if ((p = tcl_bin_field(p, &f)) == NULL) {
+            tcl_free(out);
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("bad field specifier", 19));
+        }
+        if (f.type == 'x' || f.type == 'X' || f.type == '@') {
+            size_t n = (f.count == -1 ? 1 : f.count == -2 ? 0 : (size_t)f.count);
+            unsigned char *to = (unsigned char *)out->str;
+            if (f.type == 'x') {
+                if ((to = tcl_bin_at(&out, pos, n)) != NULL) {
+                    memset(to, 0, n);
+                }
+                pos += n;
+            } else if (f.type == 'X') {
+                pos = (f.count == -2 || n > pos ? 0 : pos - n);
+            } else {
+                pos = (f.count == -2 ? out->len : n);
+                to = tcl_bin_at(&out, pos, 0);
+            }
+            if (to == NULL) {
+                return tcl_no_memory(tcl);
+            }
+            continue;
+        }
+        if (k >= argc) {
+            tcl_free(out);
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("not enough values", 17));
+        }
+        tcl_value_t *v = argv[k++];
+        if (f.type == 'a' || f.type == 'A') {
+            size_t len = tcl_length(v);
+            size_t n = (f.count == -1 ? 1 : f.count == -2 ? len : (size_t)f.count);
+            unsigned char *to = tcl_bin_at(&out, pos, n);
+            if (to == NULL) {
+                return tcl_no_memory(tcl);
+            }
+            memcpy(to, tcl_string(v), (len < n ? len : n));
+            memset(to + (len < n ? len : n), (f.type == 'a' ? 0 : ' '), (len < n ? n - len : 0));
+            pos += n;
+            continue;
+        }
+        int size = tcl_bin_size(f.type), big = tcl_bin_big(f.type);
+        unsigned long long u;
+        if (f.count == -1) {
+            if (!tcl_bin_bits(f.type, v, &u)) {
+                tcl_free(out);
+                return tcl_result(tcl, TCL_ERROR, tcl_alloc("expected number", 15));
+            }
+            unsigned char *to = tcl_bin_at(&out, pos, size);
+            if (to == NULL) {
+                return tcl_no_memory(tcl);
+            }
+            tcl_bin_put(to, u, size, big);
+            pos += size;
+            continue;
+        }
+        int n = tcl_list_length(v);
+        if (f.count != -2 && f.count > n) {
+            tcl_free(out);
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("not enough elements in list", 27));
+        }
+        n = (f.count == -2 ? n : (int)f.count);
+        unsigned char *to = tcl_bin_at(&out, pos, (size_t)n * size);
+        if (to == NULL) {
+            return tcl_no_memory(tcl);
+        }
+        struct tcl_list *l = tcl_to_list(v);
+        for (int i = 0; i < n; i++, to += size) {
+            if (!tcl_bin_bits(f.type, l->items[i], &u)) {
+                tcl_free(out);
+                return tcl_result(tcl, TCL_ERROR, tcl_alloc("expected number", 15));
+            }
+            tcl_bin_put(to, u, size, big);
+        }
+        pos += (size_t)n * size;
+    }
+    return tcl_result(tcl, TCL_OK, out);
+}
+
+/* Appends the number at p as text */
+static tcl_value_t *tcl_bin_text(tcl_value_t *v, const struct tcl_binfield *f, const unsigned char *p) {
+    int size = tcl_bin_size(f->type);
+    unsigned long long u = tcl_bin_get(p, size, tcl_bin_big(f->type));
+    char buf[64];
+    size_t n;
+    if (size == 4 && tcl_bin_float(f->type)) {
+        uint32_t bits = (uint32_t)u;
+        float x;
+        memcpy(&x, &bits, 4);
+        n = snprintf(buf, sizeof(buf), "%f", (double)x);
+    } else if (tcl_bin_float(f->type)) {
+        double x;
+        memcpy(&x, &u, 8);
+        n = snprintf(buf, sizeof(buf), "%f", x);
+    } else if (f->u) {
+        n = snprintf(buf, sizeof(buf), "%llu", u);
+    } else {
+        /* Sign extended from the top bit of the field */
+        unsigned long long sign = 1ULL << (8 * size - 1);
+        n = tcl_format_int(buf, (long long)((u ^ sign) - sign));
+    }
+    return tcl_append_string(v, buf, n);
+}
+
+/* A single number, kept in its native form where it fits one */
+static tcl_value_t *tcl_bin_number(const struct tcl_binfield *f, const unsigned char *p) {
+    int size = tcl_bin_size(f->type);
+    unsigned long long u = tcl_bin_get(p, size, tcl_bin_big(f->type));
+    if (tcl_bin_float(f->type) || (f->u && size == 8 && (long long)u < 0)) {
+        return tcl_bin_text(tcl_alloc("", 0), f, p);
+    }
+    unsigned long long sign = (f->u ? 0 : 1ULL << (8 * size - 1));
+    return tcl_alloc_int((long long)((u ^ sign) - sign));
+}
+
+static tcl_result_t tcl_bin_scan(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    const unsigned char *s = (const unsigned char *)tcl_string(argv[2]);
+    size_t len = tcl_length(argv[2]), pos = 0;
+    const char *p = tcl_string(argv[3]);
+    int k = 4, set = 0;
+    struct tcl_binfield f;
+    while (*p != '\0') {
+        if ((p = tcl_bin_field(p, &f)) == NULL) {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("bad field specifier", 19));
+        }
+        if (f.type == 'x' || f.type == 'X' || f.type == '@') {
+            size_t n = (f.count == -1 ? 1 : f.count == -2 ? 0 : (size_t)f.count);
+            if (f.type == 'x') {
+                pos = (f.count == -2 || n > len - pos ? len : pos + n);
+            } else if (f.type == 'X') {
+                pos = (f.count == -2 || n > pos ? 0 : pos - n);
+            } else {
+                pos = (f.count == -2 || n > len ? len : n);
+            }
+            continue;
+        }
+        if (k >= argc) {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("not enough variables", 20));
+        }
+        tcl_value_t *v;
+        if (f.type == 'a' || f.type == 'A') {
+            size_t n = (f.count == -1 ? 1 : f.count == -2 ? len - pos : (size_t)f.count);
+            if (n > len - pos) {
+                break;
+            }
+            size_t keep = n;
+            while (f.type == 'A' && keep > 0 && (s[pos + keep - 1] == ' ' || s[pos + keep - 1] == '\0')) {
+                keep--;
+            }
+            v = tcl_alloc((const char *)s + pos, keep);
+            pos += n;
+        } else {
+            size_t size = tcl_bin_size(f.type);
+            size_t n = (f.count == -1 ? 1 : f.count == -2 ? (len - pos) / size : (size_t)f.count);
+            if (n > (len - pos) / size) {
+                break;
+            }
+            if (f.count == -1) {
+                v = tcl_bin_number(&f, s + pos);
+            } else {
+                /* The list as its string, built in one piece */
+                v = tcl_reserve(NULL, n * (3 * size + 2));
+                for (size_t i = 0; i < n && v != NULL; i++) {
+                    if (i > 0) {
+                        v = tcl_append_string(v, " ", 1);
+                    }
+                    v = (v != NULL ? tcl_bin_text(v, &f, s + pos + i * size) : NULL);
+                }
+                if (v == NULL) {
+                    return tcl_no_memory(tcl);
+                }
+                /* Terminated even when there are no numbers at all */
+                tcl_finalize(v, 0);
+            }
+            pos += n * size;
+        }
+        tcl_var(tcl, argv[k++], v);
+        set++;
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc_int(set));
+}
+
+static tcl_result_t tcl_cmd_binary(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    const char *what = (argc > 1 ? tcl_string(argv[1]) : "");
+    if (strcmp(what, "format") == 0 && argc >= 3) {
+        return tcl_bin_format(tcl, argc, argv);
+    }
+    if (strcmp(what, "scan") == 0 && argc >= 4) {
+        return tcl_bin_scan(tcl, argc, argv);
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("binary format spec ?value ...? | binary scan bytes spec ?var ...?", 65));
+}
+
+void tcl_init_binary(struct tcl *tcl) {
+    tcl_register(tcl, "binary", tcl_cmd_binary, 0);
+}
@@ -0,0 +1,522 @@
+#include <ctype.h>
+
+#include "tinytcl.h"
+
+/* expr parses its argument into a tree of nodes once, and keeps the tree as
+ * the native form of the value (TCL_EXPR), so an expression in a loop or a
+ * proc body is not parsed again. Operands are $var, [script], numbers and
+ * "strings" or {strings} taken literally. Arithmetic is done on 64-bit
+ * integers while every operand is one, and on doubles otherwise. */
+enum tcl_eop {
+    EX_NUM, EX_STR, EX_VAR, EX_CMD,
+    EX_NEG, EX_NOT, EX_BITNOT,
+    EX_MUL, EX_DIV, EX_MOD, EX_ADD, EX_SUB, EX_SHL, EX_SHR,
+    EX_LT, EX_GT, EX_LE, EX_GE, EX_EQ, EX_NE,
+    EX_BITAND, EX_XOR, EX_BITOR, EX_AND, EX_OR, EX_COND,
+};
+
+struct tcl_enode {
+    int op;
+    int a, b, c;           /* operand nodes */
+    tcl_value_t *v;        /* number, string, variable name or script */
+    struct tcl_code *code; /* script of EX_CMD, compiled on first use */
+};
+
+struct tcl_expr {
+    int refs; /* the caching value, plus one per evaluation in progress */
+    int root;
+    struct tcl_enode *nodes;
+    int n;
+};
+
+struct tcl_eparser {
+    const char *s;
+    const char *end;
+    struct tcl_expr *e;
+};
+
+static void tcl_expr_free(struct tcl_expr *e) {
+    if (--e->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < e->n; i++) {
+        tcl_free(e->nodes[i].v);
+        tcl_code_free(e->nodes[i].code);
+    }
+    tcl_mfree(e->nodes);
+    tcl_mfree(e);
+}
+
+static int tcl_expr_node(struct tcl_expr *e, int op, int a, int b, int c, tcl_value_t *v) {
+    e->nodes = (struct tcl_enode *)tcl_grow(e->nodes, e->n, sizeof(*e->nodes));
+    struct tcl_enode *node = &e->nodes[e->n];
+    node->op = op;
+    node->a = a;
+    node->b = b;
+    node->c = c;
+    node->v = v;
+    node->code = NULL;
+    return e->n++;
+}
+
+static void tcl_expr_space(struct tcl_eparser *p) {
+    while (p->s < p->end && (tcl_is_space(*p->s) || *p->s == '\n' || *p->s == '\r')) {
+        p->s++;
+    }
+}
+
+/* Skips a bracketed or braced run starting at p->s, returns its length
+ * without the delimiters or -1 if it is not closed */
+static int tcl_expr_balanced(struct tcl_eparser *p, char open, char close) {
+    const char *from = ++p->s;
+    int depth = 1;
+    for (; p->s < p->end; p->s++) {
+        if (*p->s == open) {
+            depth++;
+        } else if (*p->s == close && --depth == 0) {
+            return (int)(p->s++ - from);
+        }
+    }
+    return -1;
+}
+
+static int tcl_expr_cond(struct tcl_eparser *p);
+
+static int tcl_expr_primary(struct tcl_eparser *p) {
+    const char *from;
+    int n;
+    tcl_expr_space(p);
+    if (p->s >= p->end) {
+        return -1;
+    }
+    from = p->s;
+    switch (*p->s) {
+        case '(':
+            p->s++;
+            n = tcl_expr_cond(p);
+            tcl_expr_space(p);
+            if (n < 0 || p->s >= p->end || *p->s != ')') {
+                return -1;
+            }
+            p->s++;
+            return n;
+        case '$':
+            p->s++;
+            if (p->s < p->end && *p->s == '{') {
+                n = tcl_expr_balanced(p, '{', '}');
+                from++;
+            } else {
+                while (p->s < p->end && (isalnum((unsigned char)*p->s) || *p->s == '_')) {
+                    p->s++;
+                }
+                n = (int)(p->s - from) - 1;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+            return tcl_expr_node(p->e, EX_VAR, -1, -1, -1, tcl_alloc(from + 1, n));
+        case '[':
+            n = tcl_expr_balanced(p, '[', ']');
+            if (n < 0) {
+                return -1;
+            }
+            return tcl_expr_node(p->e, EX_CMD, -1, -1, 0, tcl_alloc(from + 1, n));
+        case '{':
+            n = tcl_expr_balanced(p, '{', '}');
+            if (n < 0) {
+                return -1;
+            }
+            return tcl_expr_node(p->e, EX_STR, -1, -1, -1, tcl_alloc(from + 1, n));
+        case '"':
+            for (p->s++; p->s < p->end && *p->s != '"'; p->s++) {
+            }
+            if (p->s >= p->end) {
+                return -1;
+            }
+            p->s++;
+            return tcl_expr_node(p->e, EX_STR, -1, -1, -1, tcl_alloc(from + 1, p->s - from - 2));
+    }
+    if (isdigit((unsigned char)*p->s) || *p->s == '.') {
+        char *iend, *dend;
+        long long i = strtoll(from, &iend, (from[0] == '0' && (from[1] == 'x' || from[1] == 'X')) ? 16 : 10);
+        double d = strtod(from, &dend);
+        if (dend > iend) {
+            p->s = dend;
+            return tcl_expr_node(p->e, EX_NUM, -1, -1, -1, tcl_alloc_double(d));
+        }
+        if (iend == from) {
+            return -1;
+        }
+        p->s = iend;
+        return tcl_expr_node(p->e, EX_NUM, -1, -1, -1, tcl_alloc_int(i));
+    }
+    return -1;
+}
+
+static int tcl_expr_unary(struct tcl_eparser *p) {
+    int op, a;
+    tcl_expr_space(p);
+    if (p->s >= p->end) {
+        return -1;
+    }
+    switch (*p->s) {
+        case '-': op = EX_NEG; break;
+        case '!': op = EX_NOT; break;
+        case '~': op = EX_BITNOT; break;
+        case '+':
+            p->s++;
+            return tcl_expr_unary(p);
+        default:
+            return tcl_expr_primary(p);
+    }
+    p->s++;
+    a = tcl_expr_unary(p);
+    return (a < 0 ? -1 : tcl_expr_node(p->e, op, a, -1, -1, NULL));
+}
+
+/* Two-character operators first, so "<=" is not read as "<" */
+static const struct {
+    const char *s;
+    int op;
+    int prec;
+} tcl_binops[] = {
+    {"||", EX_OR, 1},   {"&&", EX_AND, 2},   {"==", EX_EQ, 6},  {"!=", EX_NE, 6},
+    {"<=", EX_LE, 7},   {">=", EX_GE, 7},    {"<<", EX_SHL, 8}, {">>", EX_SHR, 8},
+    {"|", EX_BITOR, 3}, {"^", EX_XOR, 4},    {"&", EX_BITAND, 5},
+    {"<", EX_LT, 7},    {">", EX_GT, 7},     {"+", EX_ADD, 9},  {"-", EX_SUB, 9},
+    {"*", EX_MUL, 10},  {"/", EX_DIV, 10},   {"%", EX_MOD, 10},
+};
+
+/* Precedence climbing over the binary operators binding at least as tight
+ * as prec, all of them left associative */
+static int tcl_expr_binary(struct tcl_eparser *p, int prec) {
+    int a = tcl_expr_unary(p);
+    while (a >= 0) {
+        unsigned int i;
+        size_t n = 0;
+        tcl_expr_space(p);
+        for (i = 0; i < sizeof(tcl_binops) / sizeof(tcl_binops[0]); i++) {
+            n = strlen(tcl_binops[i].s);
+            if ((size_t)(p->end - p->s) >= n && strncmp(p->s, tcl_binops[i].s, n) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(tcl_binops) / sizeof(tcl_binops[0]) || tcl_binops[i].prec < prec) {
+            break;
+        }
+        p->s += n;
+        int b = tcl_expr_binary(p, tcl_binops[i].prec + 1);
+        a = (b < 0 ? -1 : tcl_expr_node(p->e, tcl_binops[i].op, a, b, -1, NULL));
+    }
+    return a;
+}
+
+/* cond ? then : else, which groups to the right */
+static int tcl_expr_cond(struct tcl_eparser *p) {
+    int a = tcl_expr_binary(p, 1), b, c;
+    tcl_expr_space(p);
+    if (a < 0 || p->s >= p->end || *p->s != '?') {
+        return a;
+    }
+    p->s++;
+    b = tcl_expr_cond(p);
+    tcl_expr_space(p);
+    if (b < 0 || p->s >= p->end || *p->s != ':') {
+        return -1;
+    }
+    p->s++;
+    c = tcl_expr_cond(p);
+    return (c < 0 ? -1 : tcl_expr_node(p->e, EX_COND, a, b, c, NULL));
+}
+
+/* The expression tree of v, parsed on first use. NULL on a syntax error. */
+static struct tcl_expr *tcl_to_expr(tcl_value_t *v) {
+    struct tcl_eparser p;
+    if (v->type == TCL_EXPR) {
+        return v->rep.expr;
+    }
+    p.s = tcl_string(v);
+    p.end = p.s + tcl_length(v);
+    p.e = (struct tcl_expr *)tcl_calloc(1, sizeof(*p.e));
+    p.e->refs = 1;
+    p.e->root = tcl_expr_cond(&p);
+    tcl_expr_space(&p);
+    if (p.e->root < 0 || p.s != p.end) {
+        tcl_expr_free(p.e);
+        return NULL;
+    }
+    tcl_rep_free(v);
+    v->type = TCL_EXPR;
+    v->rep.expr = p.e;
+    return p.e;
+}
+
+/* An intermediate result: a number, or a string that is not one */
+struct tcl_operand {
+    int type; /* TCL_INT, TCL_DOUBLE or TCL_NONE for a string */
+    long long i;
+    double d;
+    tcl_value_t *str;
+};
+
+static void tcl_expr_operand(tcl_value_t *v, struct tcl_operand *x) {
+    x->str = NULL;
+    if (v->type != TCL_INT && v->type != TCL_DOUBLE) {
+        const char *s = tcl_string(v);
+        char *end;
+        strtod(s, &end);
+        if (end == s || *end != '\0') {
+            x->type = TCL_NONE;
+            x->str = tcl_dup(v);
+            return;
+        }
+    }
+    x->d = tcl_double(v);
+    x->i = tcl_int(v);
+    x->type = v->type;
+}
+
+/* The string of an operand, for comparisons with a string */
+static tcl_value_t *tcl_expr_string(struct tcl_operand *x) {
+    if (x->str == NULL) {
+        x->str = (x->type == TCL_INT ? tcl_alloc_int(x->i) : tcl_alloc_double(x->d));
+    }
+    return x->str;
+}
+
+static tcl_value_t *tcl_expr_value(struct tcl_operand *x) {
+    if (x->type == TCL_NONE) {
+        return x->str;
+    }
+    tcl_free(x->str);
+    return (x->type == TCL_INT ? tcl_alloc_int(x->i) : tcl_alloc_double(x->d));
+}
+
+static void tcl_expr_int(struct tcl_operand *x, long long i) {
+    tcl_free(x->str);
+    x->str = NULL;
+    x->type = TCL_INT;
+    x->i = i;
+    x->d = (double)i;
+}
+
+static tcl_result_t tcl_expr_error(struct tcl *tcl, struct tcl_operand *x, struct tcl_operand *y, const char *msg) {
+    tcl_free(x->str);
+    x->str = NULL;
+    if (y != NULL) {
+        tcl_free(y->str);
+        y->str = NULL;
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc(msg, strlen(msg)));
+}
+
+static tcl_result_t tcl_expr_truth(struct tcl *tcl, struct tcl_operand *x, int *t) {
+    if (x->type == TCL_NONE) {
+        return tcl_expr_error(tcl, x, NULL, "expected number");
+    }
+    *t = (x->type == TCL_INT ? x->i != 0 : x->d != 0);
+    return TCL_OK;
+}
+
+/* x = x op y, consuming y */
+static tcl_result_t tcl_expr_apply(struct tcl *tcl, int op, struct tcl_operand *x, struct tcl_operand *y) {
+    unsigned long long ua = (unsigned long long)x->i, ub = (unsigned long long)y->i;
+    long long a = x->i, b = y->i, q;
+    double da = x->d, db = y->d;
+    if (op >= EX_LT && op <= EX_NE && (x->type == TCL_NONE || y->type == TCL_NONE)) {
+        int cmp = tcl_compare(tcl_expr_string(x), tcl_expr_string(y));
+        tcl_free(y->str);
+        switch (op) {
+            case EX_LT: tcl_expr_int(x, cmp < 0); break;
+            case EX_GT: tcl_expr_int(x, cmp > 0); break;
+            case EX_LE: tcl_expr_int(x, cmp <= 0); break;
+            case EX_GE: tcl_expr_int(x, cmp >= 0); break;
+            case EX_EQ: tcl_expr_int(x, cmp == 0); break;
+            default: tcl_expr_int(x, cmp != 0); break;
+        }
+        return TCL_OK;
+    }
+    if (x->type == TCL_NONE || y->type == TCL_NONE) {
+        return tcl_expr_error(tcl, x, y, "expected number");
+    }
+    if (x->type == TCL_INT && y->type == TCL_INT) {
+        switch (op) {
+            /* Wrap around on overflow instead of invoking undefined behaviour */
+            case EX_MUL: a = (long long)(ua * ub); break;
+            case EX_ADD: a = (long long)(ua + ub); break;
+            case EX_SUB: a = (long long)(ua - ub); break;
+            case EX_DIV:
+            case EX_MOD:
+                if (b == 0) {
+                    return tcl_expr_error(tcl, x, y, "divide by zero");
+                }
+                /* Rounds towards negative infinity, as Tcl does */
+                q = (b == -1 ? (long long)(0 - ua) : a / b);
+                if (b != -1 && a % b != 0 && (a < 0) != (b < 0)) {
+                    q--;
+                }
+                a = (op == EX_DIV ? q : (long long)(ua - (unsigned long long)q * ub));
+                break;
+            case EX_SHL:
+            case EX_SHR:
+                if (b < 0) {
+                    return tcl_expr_error(tcl, x, y, "negative shift");
+                }
+                if (op == EX_SHL) {
+                    a = (b >= 64 ? 0 : (long long)(ua << b));
+                } else {
+                    a = (b >= 64 ? (a < 0 ? -1 : 0) : a >> b);
+                }
+                break;
+            case EX_LT: a = a < b; break;
+            case EX_GT: a = a > b; break;
+            case EX_LE: a = a <= b; break;
+            case EX_GE: a = a >= b; break;
+            case EX_EQ: a = a == b; break;
+            case EX_NE: a = a != b; break;
+            case EX_BITAND: a = a & b; break;
+            case EX_XOR: a = a ^ b; break;
+            case EX_BITOR: a = a | b; break;
+        }
+        tcl_expr_int(x, a);
+        return TCL_OK;
+    }
+    switch (op) {
+        case EX_MUL: da = da * db; break;
+        case EX_ADD: da = da + db; break;
+        case EX_SUB: da = da - db; break;
+        case EX_DIV: da = da / db; break;
+        case EX_LT: tcl_expr_int(x, da < db); return TCL_OK;
+        case EX_GT: tcl_expr_int(x, da > db); return TCL_OK;
+        case EX_LE: tcl_expr_int(x, da <= db); return TCL_OK;
+        case EX_GE: tcl_expr_int(x, da >= db); return TCL_OK;
+        case EX_EQ: tcl_expr_int(x, da == db); return TCL_OK;
+        case EX_NE: tcl_expr_int(x, da != db); return TCL_OK;
+        default:
+            return tcl_expr_error(tcl, x, y, "expected integer");
+    }
+    x->type = TCL_DOUBLE;
+    x->d = da;
+    return TCL_OK;
+}
+
+static tcl_result_t tcl_expr_eval(struct tcl *tcl, struct tcl_expr *e, int n, struct tcl_operand *x) {
+    struct tcl_enode *node = &e->nodes[n];
+    struct tcl_operand y;
+    tcl_result_t r;
+    int t = 0;
+    switch (node->op) {
+        case EX_NUM:
+        case EX_STR:
+            tcl_expr_operand(node->v, x);
+            return TCL_OK;
+        case EX_VAR:
+            tcl_expr_operand(tcl_var(tcl, node->v, NULL), x);
+            return TCL_OK;
+        case EX_CMD:
+            if (!node->c) {
+                node->code = tcl_compile(tcl, tcl_string(node->v), tcl_length(node->v) + 1);
+                node->c = 1;
+            }
+            r = tcl_run(tcl, node->code, node->v);
+            if (r == TCL_OK) {
+                tcl_expr_operand(tcl->result, x);
+            }
+            return r;
+        case EX_AND:
+        case EX_OR:
+        case EX_COND:
+            if ((r = tcl_expr_eval(tcl, e, node->a, x)) != TCL_OK || (r = tcl_expr_truth(tcl, x, &t)) != TCL_OK) {
+                return r;
+            }
+            if (node->op == EX_COND) {
+                tcl_free(x->str);
+                return tcl_expr_eval(tcl, e, t ? node->b : node->c, x);
+            }
+            if (t == (node->op == EX_AND)) {
+                if ((r = tcl_expr_eval(tcl, e, node->b, x)) != TCL_OK || (r = tcl_expr_truth(tcl, x, &t)) != TCL_OK) {
+                    return r;
+                }
+            }
+            tcl_expr_int(x, t);
+            return TCL_OK;
+    }
+    if ((r = tcl_expr_eval(tcl, e, node->a, x)) != TCL_OK) {
+        return r;
+    }
+    switch (node->op) {
+        case EX_NEG:
+            if (x->type == TCL_NONE) {
+                return tcl_expr_error(tcl, x, NULL, "expected number");
+            }
+            x->i = (long long)(0 - (unsigned long long)x->i);
+            x->d = -x->d;
+            return TCL_OK;
+        case EX_NOT:
+            if ((r = tcl_expr_truth(tcl, x, &t)) == TCL_OK) {
+                tcl_expr_int(x, !t);
+            }
+            return r;
+        case EX_BITNOT:
+            if (x->type != TCL_INT) {
+                return tcl_expr_error(tcl, x, NULL, "expected integer");
+            }
+            tcl_expr_int(x, ~x->i);
+            return TCL_OK;
+    }
+    if ((r = tcl_expr_eval(tcl, e, node->b, &y)) != TCL_OK) {
+        tcl_free(x->str);
+        return r;
+    }
+    return tcl_expr_apply(tcl, node->op, x, &y);
+}
+
+/* Evaluates v as an expression, leaving its value in the result */
+tcl_result_t tcl_expr(struct tcl *tcl, tcl_value_t *v) {
+    struct tcl_expr *e;
+    struct tcl_operand x;
+    tcl_result_t r;
+    if (v->type == TCL_INT || v->type == TCL_DOUBLE) {
+        return tcl_result(tcl, TCL_OK, tcl_dup(v));
+    }
+    e = tcl_to_expr(v);
+    if (e == NULL) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("syntax error", 12));
+    }
+    /* A [script] inside may replace the native form of v */
+    e->refs++;
+    r = tcl_expr_eval(tcl, e, e->root, &x);
+    tcl_expr_free(e);
+    if (r == TCL_OK) {
+        r = tcl_result(tcl, TCL_OK, tcl_expr_value(&x));
+    }
+    return r;
+}
+
+static tcl_result_t tcl_cmd_expr(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    tcl_value_t *e;
+    tcl_result_t r;
+    if (argc < 2) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("arity mismatch", 14));
+    }
+    if (argc == 2) {
+        return tcl_expr(tcl, argv[1]);
+    }
+    /* Several words are joined with spaces, as Tcl does */
+    e = tcl_dup(argv[1]);
+    for (int i = 2; i < argc && e != NULL; i++) {
+        e = tcl_append_string(e, " ", 1);
+        e = (e != NULL ? tcl_append_string(e, tcl_string(argv[i]), tcl_length(argv[i])) : NULL);
+    }
+    if (e == NULL) {
+        return tcl_no_memory(tcl);
+    }
+    r = tcl_expr(tcl, e);
+    tcl_free(e);
+    return r;
+}
+
+void tcl_init_expr(struct tcl *tcl) {
+    tcl_register(tcl, "expr", tcl_cmd_expr, 0);
+}
@@ -0,0 +1,176 @@
+#include "tinytcl.h"
+
+/* info reports on the interpreter itself:
+ *
+ *   info profile          {name calls inclusive exclusive bytes} for every
+ *                         command called so far, costliest (exclusive time)
+ *                         first, times in microseconds
+ *   info profile reset    zeroes the counters
+ *   info memory           {bytes N peak N blocks N limit N} of this
+ *                         interpreter's heap, see struct tcl_heap
+ *   info trace on|off     starts or stops recording events
+ *   info trace clear      drops the events recorded so far
+ *   info trace            the events as Chrome trace JSON
+ *
+ * The counters only exist when built with TCL_PROFILE, the heap figures
+ * with TCL_ACCOUNT and the trace with TCL_TRACE. */
+
+#if TCL_PROFILE
+static int tcl_prof_order(const void *a, const void *b) {
+    const struct tcl_cmd *x = *(const struct tcl_cmd **)a;
+    const struct tcl_cmd *y = *(const struct tcl_cmd **)b;
+    return (x->prof.excl < y->prof.excl) - (x->prof.excl > y->prof.excl);
+}
+
+static tcl_result_t tcl_info_profile(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    struct tcl_cmd **cmds = (struct tcl_cmd **)tcl_malloc((tcl->ncmds + 1) * sizeof(*cmds));
+    int n = 0;
+    int reset = (argc > 2 && strcmp(tcl_string(argv[2]), "reset") == 0);
+    for (int i = 0; i < tcl->cmdslen; i++) {
+        for (struct tcl_cmd *cmd = tcl->cmds[i]; cmd != NULL; cmd = cmd->next) {
+            if (reset) {
+                memset(&cmd->prof, 0, sizeof(cmd->prof));
+            } else if (cmd->prof.calls > 0) {
+                cmds[n++] = cmd;
+            }
+        }
+    }
+    qsort(cmds, n, sizeof(*cmds), tcl_prof_order);
+    tcl_value_t *table = tcl_list_alloc();
+    for (int i = 0; i < n; i++) {
+        tcl_value_t *row = tcl_list_alloc();
+        tcl_value_t *field[5] = {
+            tcl_dup(cmds[i]->name),
+            tcl_alloc_int(cmds[i]->prof.calls),
+            tcl_alloc_int(cmds[i]->prof.incl / TCL_TICKS_PER_US),
+            tcl_alloc_int(cmds[i]->prof.excl / TCL_TICKS_PER_US),
+            tcl_alloc_int(cmds[i]->prof.bytes),
+        };
+        for (int j = 0; j < 5; j++) {
+            row = tcl_list_append(row, field[j]);
+            tcl_free(field[j]);
+        }
+        table = tcl_list_append(table, row);
+        tcl_free(row);
+    }
+    tcl_mfree(cmds);
+    return tcl_result(tcl, TCL_OK, table);
+}
+#endif
+
+#if TCL_ACCOUNT
+static tcl_result_t tcl_info_memory(struct tcl *tcl) {
+    const char *names[] = {"bytes", "peak", "blocks", "limit"};
+    size_t values[] = {tcl->heap.bytes, tcl->heap.peak, tcl->heap.blocks, tcl->heap.limit};
+    tcl_value_t *info = tcl_list_alloc();
+    for (int i = 0; i < 4; i++) {
+        tcl_value_t *name = tcl_alloc(names[i], strlen(names[i]));
+        tcl_value_t *value = tcl_alloc_int(values[i]);
+        info = tcl_list_append(tcl_list_append(info, name), value);
+        tcl_free(name);
+        tcl_free(value);
+    }
+    return tcl_result(tcl, TCL_OK, info);
+}
+#endif
+
+#if TCL_TRACE
+/* Sink for tcl_trace_write(), e.g. a Print on the device or a FILE on the
+ * host */
+typedef void (*tcl_write_fn_t)(void *ctx, const char *s, size_t n);
+
+static void tcl_write_json(tcl_write_fn_t fn, void *ctx, const char *s) {
+    for (; *s != '\0'; s++) {
+        char esc[8];
+        if (*s == '"' || *s == '\\') {
+            esc[0] = '\\';
+            esc[1] = *s;
+            fn(ctx, esc, 2);
+        } else if ((unsigned char)*s < 0x20) {
+            fn(ctx, esc, snprintf(esc, sizeof(esc), "\\u%04x", *s));
+        } else {
+            fn(ctx, s, 1);
+        }
+    }
+}
+
+/* Writes the events in the ring, oldest first, in the Chrome trace event
+ * format that chrome://tracing and Perfetto load. Times are microseconds
+ * since the oldest event. */
+void tcl_trace_write(struct tcl *tcl, tcl_write_fn_t fn, void *ctx) {
+    struct tcl_trace *tr = &tcl->trace;
+    unsigned long first = (tr->n > TCL_TRACE ? tr->n - TCL_TRACE : 0);
+    static const char *cats[] = {"cmd", "proc", "loop"};
+    char buf[128];
+    fn(ctx, "{\"traceEvents\":[", 16);
+    for (unsigned long i = first; i < tr->n; i++) {
+        struct tcl_event *e = &tr->ring[i % TCL_TRACE];
+        unsigned long t = e->t - tr->ring[first % TCL_TRACE].t;
+        fn(ctx, (i == first ? "\n{\"name\":\"" : ",\n{\"name\":\""), (i == first ? 10 : 11));
+        tcl_write_json(fn, ctx, e->name);
+        fn(ctx, buf, snprintf(buf, sizeof(buf),
+           "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":1,\"tid\":1,"
+           "\"args\":{\"depth\":%d,\"iteration\":%ld}}",
+           cats[e->cat == 'c' ? 0 : e->cat == 'p' ? 1 : 2], e->ph,
+           t / TCL_TICKS_PER_US, t % TCL_TICKS_PER_US * 1000 / TCL_TICKS_PER_US,
+           e->depth, e->iter));
+    }
+    fn(ctx, "\n]}\n", 4);
+}
+
+static void tcl_write_value(void *ctx, const char *s, size_t n) {
+    tcl_value_t **v = (tcl_value_t **)ctx;
+    *v = tcl_append_string(*v, s, n);
+}
+
+static tcl_result_t tcl_info_trace(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    struct tcl_trace *tr = &tcl->trace;
+    const char *what = (argc > 2 ? tcl_string(argv[2]) : "");
+    if (strcmp(what, "on") == 0 || strcmp(what, "off") == 0) {
+        /* Whatever is running now began unrecorded, so start at the top */
+        tr->on = (what[1] == 'n');
+        tr->depth = 0;
+        memset(tr->loop, 0, sizeof(tr->loop));
+    } else if (strcmp(what, "clear") == 0) {
+        tr->n = 0;
+    } else if (argc == 2) {
+        tcl_value_t *json = tcl_alloc("", 0);
+        tcl_trace_write(tcl, tcl_write_value, &json);
+        return tcl_result(tcl, TCL_OK, json);
+    } else {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("info trace ?on|off|clear?", 25));
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+#endif
+
+static tcl_result_t tcl_cmd_info(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    const char *what = (argc > 1 ? tcl_string(argv[1]) : "");
+    if (strcmp(what, "profile") == 0) {
+#if TCL_PROFILE
+        return tcl_info_profile(tcl, argc, argv);
+#else
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("built without TCL_PROFILE", 25));
+#endif
+    }
+    if (strcmp(what, "memory") == 0) {
+#if TCL_ACCOUNT
+        return tcl_info_memory(tcl);
+#else
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("built without TCL_ACCOUNT", 25));
+#endif
+    }
+    if (strcmp(what, "trace") == 0) {
+#if TCL_TRACE
+        return tcl_info_trace(tcl, argc, argv);
+#else
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("built without TCL_TRACE", 23));
+#endif
+    }
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("info what?", 10));
+}
+
+void tcl_init_info(struct tcl *tcl) {
+    tcl_register(tcl, "info", tcl_cmd_info, 0);
+}
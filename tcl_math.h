@@ -1,16 +1,12 @@
 #include "tinytcl.h"
 
-static tcl_result_t tcl_cmd_math(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)arg;
-    char buf[64];
-    tcl_value_t *opval = tcl_list_at(args, 0);
-    tcl_value_t *aval = tcl_list_at(args, 1);
-    tcl_value_t *bval = tcl_list_at(args, 2);
-    const char *op = tcl_string(opval);
+static tcl_result_t tcl_cmd_math(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    const char *op = tcl_string(argv[0]);
     int opnum = op[0] << 8 | op[1];
-    float a = tcl_num(aval);
-    float b = tcl_num(bval);
-    float c = 0;
+    double a = tcl_double(argv[1]);
+    double b = tcl_double(argv[2]);
+    double c = 0;
     switch (opnum) {
         case 0x2b00: c = a + b; break;
         case 0x2d00: c = a - b; break;
@@ -23,15 +19,12 @@ static tcl_result_t tcl_cmd_math(struct tcl *tcl, tcl_value_t *args, void *arg)
         case 0x3d3d: c = a == b; break;
         case 0x213d: c = a != b; break;
     }
-    sprintf(buf, "%f", c);
-    tcl_free(opval);
-    tcl_free(aval);
-    tcl_free(bval);
-    return tcl_result(tcl, TCL_OK, tcl_alloc(buf, strlen(buf)));
+    /* Stays a double until someone reads it as a string */
+    return tcl_result(tcl, TCL_OK, tcl_alloc_double(c));
 }
 
 void tcl_init_math(struct tcl *tcl) {
-    char *math[] = {"+", "-", "*", "/", ">", ">=", "<", "<=", "==", "!="};
+    const char *math[] = {"+", "-", "*", "/", ">", ">=", "<", "<=", "==", "!="};
     for (unsigned int i = 0; i < (sizeof(math) / sizeof(math[0])); i++) {
         tcl_register(tcl, math[i], tcl_cmd_math, 3, NULL);
     }
@@ -0,0 +1,227 @@
+#include "tinytcl.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/* A pool of interpreters, each on a thread of its own, built with
+ * TCL_POOL. They all share the commands of one interpreter set up
+ * beforehand (see tcl_init_shared()) and talk by passing strings:
+ *
+ *   send id message       queues a copy of message for interpreter id,
+ *                         where 0 is the host and 1 to n the workers
+ *   receive var ?ms?      takes the next message for this interpreter into
+ *                         var, waiting up to ms (forever by default), and
+ *                         returns 1, or 0 if none came in time
+ *   self                  this interpreter's id
+ *
+ * A worker evaluates each message that reaches it while idle as a script;
+ * receive inside that script takes the ones that follow as data. Errors go
+ * to the host as the list {error id message}.
+ *
+ * Each mailbox is a lock-free queue with many senders and one receiver, its
+ * owner. Waiting receivers spin briefly, then sleep in short steps. */
+
+/* Messages are plain malloc() blocks, as they belong to no heap on the way */
+struct tcl_msg {
+    std::atomic<struct tcl_msg *> next;
+    size_t len;
+    char str[1]; /* NUL terminated */
+};
+
+/* Vyukov's intrusive queue: senders swap themselves in at head, the
+ * receiver walks from tail, and stub stands in when it runs empty */
+struct tcl_mailbox {
+    std::atomic<struct tcl_msg *> head;
+    struct tcl_msg *tail;
+    struct tcl_msg stub;
+};
+
+struct tcl_pool;
+
+struct tcl_worker {
+    struct tcl_pool *pool;
+    int id;
+    struct tcl_mailbox mailbox;
+    std::thread thread;
+};
+
+struct tcl_pool {
+    const struct tcl *shared;
+    int n;
+    struct tcl_worker *workers; /* 0 is the host, which has no thread */
+    std::atomic<int> stop;
+};
+
+static void tcl_mailbox_init(struct tcl_mailbox *box) {
+    box->stub.next.store(NULL);
+    box->head.store(&box->stub);
+    box->tail = &box->stub;
+}
+
+static void tcl_mailbox_push(struct tcl_mailbox *box, struct tcl_msg *m) {
+    m->next.store(NULL, std::memory_order_relaxed);
+    struct tcl_msg *prev = box->head.exchange(m, std::memory_order_acq_rel);
+    prev->next.store(m, std::memory_order_release);
+}
+
+/* Next message, NULL if there is none, or one is halfway in */
+static struct tcl_msg *tcl_mailbox_pop(struct tcl_mailbox *box) {
+    struct tcl_msg *tail = box->tail;
+    struct tcl_msg *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &box->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        box->tail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != NULL) {
+        box->tail = next;
+        return tail;
+    }
+    if (tail != box->head.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    /* tail is the last one: put the stub behind it before taking it */
+    tcl_mailbox_push(box, &box->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != NULL) {
+        box->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static struct tcl_msg *tcl_msg_alloc(const char *s, size_t len) {
+    struct tcl_msg *m = (struct tcl_msg *)malloc(sizeof(*m) + len);
+    m->len = len;
+    memcpy(m->str, s, len);
+    m->str[len] = '\0';
+    return m;
+}
+
+/* Waits up to ms for a message (ms < 0 = forever), giving up early with
+ * NULL once the pool stops and the mailbox is empty */
+static struct tcl_msg *tcl_mailbox_wait(struct tcl_pool *pool, struct tcl_mailbox *box, long ms) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    for (int spins = 0;; spins++) {
+        struct tcl_msg *m = tcl_mailbox_pop(box);
+        if (m != NULL) {
+            return m;
+        }
+        if (pool->stop.load(std::memory_order_acquire) || (ms >= 0 && std::chrono::steady_clock::now() >= until)) {
+            return NULL;
+        }
+        if (spins < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+/* Queues a copy of s for interpreter id, 0 on success */
+int tcl_pool_send(struct tcl_pool *pool, int id, const char *s, size_t len) {
+    if (id < 0 || id > pool->n) {
+        return -1;
+    }
+    tcl_mailbox_push(&pool->workers[id].mailbox, tcl_msg_alloc(s, len));
+    return 0;
+}
+
+/* Next message sent to the host, waiting up to ms (ms < 0 = forever), or
+ * NULL. The caller free()s it. */
+struct tcl_msg *tcl_pool_receive(struct tcl_pool *pool, long ms) {
+    return tcl_mailbox_wait(pool, &pool->workers[0].mailbox, ms);
+}
+
+static tcl_result_t tcl_cmd_send(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)argc;
+    struct tcl_worker *w = (struct tcl_worker *)arg;
+    if (tcl_pool_send(w->pool, (int)tcl_int(argv[1]), tcl_string(argv[2]), tcl_length(argv[2])) != 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("no such interpreter", 19));
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+static tcl_result_t tcl_cmd_receive(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    struct tcl_worker *w = (struct tcl_worker *)arg;
+    if (argc != 2 && argc != 3) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("receive var ?ms?", 16));
+    }
+    struct tcl_msg *m = tcl_mailbox_wait(w->pool, &w->mailbox, (argc > 2 ? (long)tcl_int(argv[2]) : -1));
+    if (m == NULL) {
+        return tcl_result(tcl, TCL_OK, tcl_alloc_int(0));
+    }
+    tcl_var(tcl, argv[1], tcl_alloc(m->str, m->len));
+    free(m);
+    return tcl_result(tcl, TCL_OK, tcl_alloc_int(1));
+}
+
+static tcl_result_t tcl_cmd_self(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)argc, (void)argv;
+    return tcl_result(tcl, TCL_OK, tcl_alloc_int(((struct tcl_worker *)arg)->id));
+}
+
+static void tcl_worker_report(struct tcl_worker *w, tcl_value_t *msg) {
+    tcl_value_t *report = tcl_list_alloc();
+    tcl_value_t *field[3] = {tcl_alloc("error", 5), tcl_alloc_int(w->id), tcl_dup(msg)};
+    for (int i = 0; i < 3; i++) {
+        report = tcl_list_append(report, field[i]);
+        tcl_free(field[i]);
+    }
+    tcl_pool_send(w->pool, 0, tcl_string(report), tcl_length(report));
+    tcl_free(report);
+}
+
+static void tcl_worker_run(struct tcl_worker *w) {
+    struct tcl tcl;
+    struct tcl_msg *m;
+    tcl_init_shared(&tcl, w->pool->shared);
+    tcl_register(&tcl, "send", tcl_cmd_send, 3, w, tcl_borrowed);
+    tcl_register(&tcl, "receive", tcl_cmd_receive, 0, w, tcl_borrowed);
+    tcl_register(&tcl, "self", tcl_cmd_self, 1, w, tcl_borrowed);
+    while ((m = tcl_mailbox_wait(w->pool, &w->mailbox, -1)) != NULL) {
+        if (tcl_eval(&tcl, m->str, m->len + 1) == TCL_ERROR) {
+            tcl_worker_report(w, tcl.result);
+        }
+        free(m);
+    }
+    tcl_destroy(&tcl);
+}
+
+/* Starts n interpreters sharing the commands of shared, which must not be
+ * changed or run until the pool is freed */
+struct tcl_pool *tcl_pool_new(const struct tcl *shared, int n) {
+    struct tcl_pool *pool = new tcl_pool;
+    pool->shared = shared;
+    pool->n = n;
+    pool->stop.store(0);
+    pool->workers = new tcl_worker[n + 1];
+    for (int i = 0; i <= n; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        tcl_mailbox_init(&pool->workers[i].mailbox);
+    }
+    for (int i = 1; i <= n; i++) {
+        pool->workers[i].thread = std::thread(tcl_worker_run, &pool->workers[i]);
+    }
+    return pool;
+}
+
+/* Lets the workers finish what has been sent to them, stops them and frees
+ * the pool along with any messages nobody took */
+void tcl_pool_free(struct tcl_pool *pool) {
+    pool->stop.store(1, std::memory_order_release);
+    for (int i = 1; i <= pool->n; i++) {
+        pool->workers[i].thread.join();
+    }
+    for (int i = 0; i <= pool->n; i++) {
+        struct tcl_msg *m;
+        while ((m = tcl_mailbox_pop(&pool->workers[i].mailbox)) != NULL) {
+            free(m);
+        }
+    }
+    delete[] pool->workers;
+    delete pool;
+}
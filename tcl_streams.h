@@ -3,193 +3,553 @@
 #include <Print.h>
 #include <SPI.h>
 #include <SD.h>
+#if TCL_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Channels. Every open stream is an entry in the interpreter's channel
+ * table, named chanN after its index, so finding one takes no search.
+ * Entry 0, also called stdout and stdin, is the default serial port (the
+ * process's stdin and stdout with TCL_POSIX) and is there from the start.
+ *
+ *   open name ?mode|baud?  /dev/serial0 to 3 (at baud), /dev/spi, or a file
+ *                          to read (r), write (w) or append to (a)
+ *   close chan             any but the standard channel
+ *   puts ?-nonewline? ?chan? text
+ *   gets chan ?var?        the next line, or with var its length, -1 if
+ *                          there is no whole line yet or the end was reached
+ *   read chan ?n?          all there is for now, or n bytes at most
+ *   flush chan
+ *   fconfigure chan ?-buffering full|line|none? ?-buffersize n?
+ *   source file
+ *
+ * Output is gathered in a buffer of TCL_CHAN_BUFFER bytes and handed to the
+ * driver when it fills (full buffering), also at the end of each line (line
+ * buffering), or written straight through (none). Serial ports start line
+ * buffered, files fully buffered and SPI unbuffered. Input is read ahead
+ * into a buffer as well, which gets splits lines out of. */
 
-/* File Identifier format:
-SDCard File: 0x1C + 4 bytes pointer to file object
-Serial port: 0x11 + port number
-SPI port:    0x12
+/* What a kind of stream does, for the channels of that kind */
+struct tcl_driver {
+    /* Writes n bytes, returns how many it did, -1 on failure */
+    int (*write)(void *ctx, const char *buf, size_t n);
+    /* Reads up to n bytes, returns how many: 0 when there are none yet,
+     * -1 at the end */
+    int (*read)(void *ctx, char *buf, size_t n);
+    void (*flush)(void *ctx);
+    void (*close)(void *ctx);
+    char buffering;
+    char sized; /* the data never ends, so read needs a count */
+};
 
-*/
+struct tcl_chan {
+    const struct tcl_driver *driver; /* NULL while the entry is free */
+    void *ctx;
+    char buffering; /* 'f'ull, 'l'ine or 'n'one */
+    size_t size;    /* of the output buffer */
+    char *out;      /* allocated on the first buffered write */
+    size_t outlen;
+    char *in; /* read ahead, in[inpos, inlen) not taken yet */
+    size_t inpos;
+    size_t inlen;
+    size_t incap;
+};
 
-static Print *serials = {
-    Serial,
+static Stream *const serials[] = {
+    &Serial,
 #ifdef Serial1
-    Serial1,
+    &Serial1,
 #endif
-#ifdef Serial1
-    Serial2,
+#ifdef Serial2
+    &Serial2,
 #endif
+#ifdef Serial3
+    &Serial3,
+#endif
+};
+
+/* Not every core's Serial is a HardwareSerial, so begin() goes by name */
+static void tcl_serial_begin(unsigned int portnum, int baud) {
+    switch (portnum) {
+        case 0: Serial.begin(baud); break;
 #ifdef Serial1
-    Serial3,
+        case 1: Serial1.begin(baud); break;
+#endif
+#ifdef Serial2
+        case 2: Serial2.begin(baud); break;
 #endif
+#ifdef Serial3
+        case 3: Serial3.begin(baud); break;
+#endif
+    }
+}
+
+static int tcl_serial_write(void *ctx, const char *buf, size_t n) {
+    return (int)((Stream *)ctx)->write((const uint8_t *)buf, n);
+}
+
+static int tcl_serial_read(void *ctx, char *buf, size_t n) {
+    Stream *port = (Stream *)ctx;
+    int a = port->available();
+    return (a > 0 ? (int)port->readBytes(buf, (size_t)a < n ? (size_t)a : n) : 0);
+}
+
+static void tcl_serial_flush(void *ctx) { ((Stream *)ctx)->flush(); }
+
+/* Serial ports stay open, and closing SPI would cut off the SD card */
+static void tcl_never_close(void *ctx) { (void)ctx; }
+
+static const struct tcl_driver tcl_serial_driver = {
+    tcl_serial_write, tcl_serial_read, tcl_serial_flush, tcl_never_close, 'l', 0,
+};
+
+/* SPI transfers overwrite the buffer with what comes back, so writes go a
+ * byte at a time and reads clock out zeroes */
+static int tcl_spi_write(void *ctx, const char *buf, size_t n) {
+    (void)ctx;
+    for (size_t i = 0; i < n; i++) {
+        SPI.transfer((uint8_t)buf[i]);
+    }
+    return (int)n;
+}
+
+static int tcl_spi_read(void *ctx, char *buf, size_t n) {
+    (void)ctx;
+    memset(buf, 0, n);
+    SPI.transfer(buf, n);
+    return (int)n;
+}
+
+static void tcl_spi_flush(void *ctx) { (void)ctx; }
+
+static const struct tcl_driver tcl_spi_driver = {
+    tcl_spi_write, tcl_spi_read, tcl_spi_flush, tcl_never_close, 'n', 1,
+};
+
+#if TCL_POSIX
+/* Files are file descriptors, kept in the context pointer */
+static int tcl_fd_write(void *ctx, const char *buf, size_t n) {
+    return (int)write((int)(intptr_t)ctx, buf, n);
+}
+
+static int tcl_fd_read(void *ctx, char *buf, size_t n) {
+    ssize_t got = read((int)(intptr_t)ctx, buf, n);
+    return (got > 0 ? (int)got : -1);
+}
+
+static void tcl_fd_flush(void *ctx) { (void)ctx; }
+
+static void tcl_fd_close(void *ctx) { close((int)(intptr_t)ctx); }
+
+static const struct tcl_driver tcl_file_driver = {
+    tcl_fd_write, tcl_fd_read, tcl_fd_flush, tcl_fd_close, 'f', 0,
+};
+
+/* The process's stdout for writing and stdin for reading */
+static int tcl_stdout_write(void *ctx, const char *buf, size_t n) {
+    (void)ctx;
+    fflush(stdout); /* anything the host printf()ed goes first */
+    return tcl_fd_write((void *)1, buf, n);
+}
+
+static int tcl_stdin_read(void *ctx, char *buf, size_t n) {
+    (void)ctx;
+    return tcl_fd_read((void *)0, buf, n);
+}
+
+static const struct tcl_driver tcl_stdio_driver = {
+    tcl_stdout_write, tcl_stdin_read, tcl_fd_flush, tcl_never_close, 'l', 0,
+};
+
+static void *tcl_open_file(const char *name, const char *mode) {
+    int flags = (mode[0] == 'w' ? O_WRONLY | O_CREAT | O_TRUNC : mode[0] == 'a' ? O_WRONLY | O_CREAT | O_APPEND : O_RDONLY);
+    int fd = open(name, flags, 0666);
+    return (fd < 0 ? NULL : (void *)(intptr_t)fd);
+}
+#else
+static int tcl_sd_write(void *ctx, const char *buf, size_t n) {
+    return (int)((File *)ctx)->write((const uint8_t *)buf, n);
+}
+
+static int tcl_sd_read(void *ctx, char *buf, size_t n) {
+    int got = ((File *)ctx)->read((uint8_t *)buf, n);
+    return (got > 0 ? got : -1);
+}
+
+static void tcl_sd_flush(void *ctx) { ((File *)ctx)->flush(); }
+
+static void tcl_sd_close(void *ctx) {
+    File *f = (File *)ctx;
+    f->close();
+    delete f;
+}
+
+static const struct tcl_driver tcl_file_driver = {
+    tcl_sd_write, tcl_sd_read, tcl_sd_flush, tcl_sd_close, 'f', 0,
+};
+
+static void *tcl_open_file(const char *name, const char *mode) {
+    if (mode[0] == 'w') {
+        SD.remove(name);
+    }
+    File f = SD.open(name, (mode[0] == 'w' || mode[0] == 'a') ? FILE_WRITE : FILE_READ);
+    return (f ? new File(f) : NULL);
+}
+#endif
+
+/* Takes the first free entry, growing the table if there is none */
+static int tcl_chan_open(struct tcl *tcl, const struct tcl_driver *driver, void *ctx) {
+    int i;
+    for (i = 0; i < tcl->nchans && tcl->chans[i].driver != NULL; i++) {
+    }
+    if (i == tcl->nchans) {
+        tcl->nchans = (tcl->nchans == 0 ? 4 : 2 * tcl->nchans);
+        tcl->chans = (struct tcl_chan *)tcl_realloc(tcl->chans, tcl->nchans * sizeof(*tcl->chans));
+        memset(tcl->chans + i, 0, (tcl->nchans - i) * sizeof(*tcl->chans));
+    }
+    struct tcl_chan *ch = &tcl->chans[i];
+    memset(ch, 0, sizeof(*ch));
+    ch->driver = driver;
+    ch->ctx = ctx;
+    ch->buffering = driver->buffering;
+    ch->size = TCL_CHAN_BUFFER;
+    return i;
+}
+
+/* The table, set up with the standard channel on first use */
+static struct tcl_chan *tcl_chans(struct tcl *tcl) {
+    if (tcl->chans == NULL) {
+#if TCL_POSIX
+        tcl_chan_open(tcl, &tcl_stdio_driver, NULL);
+#else
+        tcl_chan_open(tcl, &tcl_serial_driver, serials[0]);
+#endif
+    }
+    return tcl->chans;
+}
+
+/* Channel called name, NULL if none is open by that name */
+static struct tcl_chan *tcl_chan(struct tcl *tcl, tcl_value_t *name) {
+    const char *s = tcl_string(name);
+    struct tcl_chan *chans = tcl_chans(tcl);
+    long i = -1;
+    char *end;
+    if (strcmp(s, "stdout") == 0 || strcmp(s, "stdin") == 0) {
+        i = 0;
+    } else if (strncmp(s, "chan", 4) == 0 && s[4] >= '0' && s[4] <= '9') {
+        i = strtol(s + 4, &end, 10);
+        i = (*end == '\0' ? i : -1);
+    }
+    return (i >= 0 && i < tcl->nchans && chans[i].driver != NULL ? &chans[i] : NULL);
+}
+
+static int tcl_chan_put(struct tcl_chan *ch, const char *s, size_t n) {
+    while (n > 0) {
+        int done = ch->driver->write(ch->ctx, s, n);
+        if (done <= 0) {
+            return -1;
+        }
+        s += done;
+        n -= done;
+    }
+    return 0;
+}
+
+/* Hands the buffered output to the driver */
+static int tcl_chan_drain(struct tcl_chan *ch) {
+    int r = tcl_chan_put(ch, ch->out, ch->outlen);
+    ch->outlen = 0;
+    return r;
 }
 
-static tcl_result_t tcl_cmd_puts(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_chan_write(struct tcl_chan *ch, const char *s, size_t n) {
+    if (ch->buffering == 'n') {
+        return tcl_chan_drain(ch) | tcl_chan_put(ch, s, n);
+    }
+    if (ch->outlen + n > ch->size) {
+        if (tcl_chan_drain(ch) < 0) {
+            return -1;
+        }
+        if (n >= ch->size) {
+            return tcl_chan_put(ch, s, n);
+        }
+    }
+    if (ch->out == NULL) {
+        ch->out = (char *)tcl_malloc(ch->size);
+    }
+    memcpy(ch->out + ch->outlen, s, n);
+    ch->outlen += n;
+    if (ch->buffering == 'l' && memchr(s, '\n', n) != NULL) {
+        return tcl_chan_drain(ch);
+    }
+    return 0;
+}
+
+/* Reads more into the input buffer, returning what the driver did */
+static int tcl_chan_fill(struct tcl_chan *ch) {
+    if (ch->inpos > 0) {
+        memmove(ch->in, ch->in + ch->inpos, ch->inlen - ch->inpos);
+        ch->inlen -= ch->inpos;
+        ch->inpos = 0;
+    }
+    if (ch->inlen == ch->incap) {
+        /* A line longer than the buffer */
+        ch->incap = (ch->incap == 0 ? ch->size : 2 * ch->incap);
+        ch->in = (char *)tcl_realloc(ch->in, ch->incap);
+    }
+    int got = ch->driver->read(ch->ctx, ch->in + ch->inlen, ch->incap - ch->inlen);
+    if (got > 0) {
+        ch->inlen += got;
+    }
+    return got;
+}
+
+static void tcl_chan_close(struct tcl_chan *ch) {
+    tcl_chan_drain(ch);
+    ch->driver->close(ch->ctx);
+    tcl_mfree(ch->out);
+    tcl_mfree(ch->in);
+    ch->driver = NULL;
+}
+
+static void tcl_chans_free(struct tcl *tcl) {
+    for (int i = 0; i < tcl->nchans; i++) {
+        if (tcl->chans[i].driver != NULL) {
+            tcl_chan_close(&tcl->chans[i]);
+        }
+    }
+    tcl_mfree(tcl->chans);
+    tcl->chans = NULL;
+    tcl->nchans = 0;
+}
+
+static tcl_result_t tcl_no_chan(struct tcl *tcl) {
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("no such channel", 15));
+}
+
+static tcl_result_t tcl_cmd_puts(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
-    tcl_value_t *text;
-    uintptr_t fp;
-    int portnum = 0;
     bool newline = true;
-    i = 1;
-    File f;
-    text = tcl_list_at(args, i);
-    if (strcmp(text, "-nonewline") == 0) {
+    int i = 1;
+    if (argc > 2 && strcmp(tcl_string(argv[i]), "-nonewline") == 0) {
         newline = false;
         i++;
-        tcl_free(text);
-        text = tcl_list_at(args, i);
-    }
-    if (text[0] == 0x1C) { // ASCII file separator ==> file pointer
-        fp = (uintptr_t)*(text + 1);
-        f = (File)*fp; // pointers
-        tcl_free(text);
-        text = tcl_list_at(args, i + 1);
-        if (newline) f.println(tcl_string(text));
-        else f.print(tcl_string(text));
-    }
-    else if (text[0] == 0x11) { // ASCII Device Control 1 ==> serial port
-        portnum = text[1] - '0';
-        tcl_free(text);
-        text = tcl_list_at(args, i + 1);
-        Print *port = serials[portnum];
-        if (newline) port->println(tcl_string(text));
-        else port->print(tcl_string(text));
-    }
-    else if (text[0] == 0x12) { // ASCII Device Control 2 ==> SPI port
-        tcl_free(text);
-        text = tcl_list_at(args, i + 1);
-        SPI.transfer(tcl_string(text), tcl_length(text));
-    }
-    else {
-        // default to serial
-        if (newline) Serial.println(tcl_string(text));
-        else Serial.print(tcl_string(text));
-    }
-    tcl_free(text);
-    return tcl_result(tcl, TCL_OK, text);
+    }
+    if (argc - i != 1 && argc - i != 2) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("puts ?-nonewline? ?channel? text", 32));
+    }
+    tcl_value_t *text = argv[argc - 1];
+    struct tcl_chan *ch = (argc - i == 2 ? tcl_chan(tcl, argv[i]) : tcl_chans(tcl));
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
+    }
+    if (tcl_chan_write(ch, tcl_string(text), tcl_length(text)) < 0 || (newline && tcl_chan_write(ch, "\n", 1) < 0)) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("write failed", 12));
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+static tcl_result_t tcl_cmd_gets(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    if (argc != 2 && argc != 3) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("gets channel ?var?", 18));
+    }
+    struct tcl_chan *ch = tcl_chan(tcl, argv[1]);
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
+    }
+    tcl_value_t *line = NULL;
+    for (;;) {
+        char *start = ch->in + ch->inpos;
+        char *nl = (ch->inpos < ch->inlen ? (char *)memchr(start, '\n', ch->inlen - ch->inpos) : NULL);
+        if (nl != NULL) {
+            size_t n = nl - start;
+            ch->inpos += n + 1;
+            line = tcl_alloc(start, (n > 0 && nl[-1] == '\r' ? n - 1 : n));
+            break;
+        }
+        int got = tcl_chan_fill(ch);
+        if (got < 0 && ch->inlen > ch->inpos) {
+            /* The last line, with no newline at the end */
+            line = tcl_alloc(ch->in + ch->inpos, ch->inlen - ch->inpos);
+            ch->inpos = ch->inlen;
+            break;
+        }
+        if (got <= 0) {
+            break;
+        }
+    }
+    if (argc == 2) {
+        return tcl_result(tcl, TCL_OK, line != NULL ? line : tcl_alloc("", 0));
+    }
+    if (line == NULL) {
+        return tcl_result(tcl, TCL_OK, tcl_alloc_int(-1));
+    }
+    tcl_var(tcl, argv[2], line);
+    return tcl_result(tcl, TCL_OK, tcl_alloc_int(tcl_length(line)));
 }
 
-static tcl_result_t tcl_cmd_read(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static tcl_result_t tcl_cmd_read(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
-    tcl_value_t *fd;
-    tcl_value_t *text;
-    uintptr_t fp;
-    int portnum = 0;
-    File f;
-    int a;
-    fd = tcl_list_at(args, 1);
-    if (fd[0] == 0x1C) { // ASCII file separator ==> file pointer
-        fp = (uintptr_t)*(fd + 1);
-        f = (File)*fp; // pointers
-        a = f.available();
-        text = tcl_alloc("", a);
-        f.read(text, a);
-    }
-    else if (fd[0] == 0x11) { // ASCII Device Control 1 ==> serial port
-        portnum = fd[1] - '0';
-        Print *port = serials[portnum];
-        a = port->available();
-        text = tcl_alloc("", a);
-        port->readBytes(text, a);
-    }
-    else if (fd[0] == 0x12) { // ASCII Device Control 2 ==> SPI port
-        tcl_value_t *amount = tcl_list_at(args, 2);
-        a = (int)tcl_num(amount);
-        text = tcl_alloc("", a);
-        SPI.transfer((char *)text, a);
-    }
-    else {
-        // default to serial
-        if (newline) Serial.println(tcl_string(fd));
-        else Serial.print(tcl_string(fd));
-    }
-    tcl_free(fd);
+    if (argc != 2 && argc != 3) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("read channel ?amount?", 21));
+    }
+    struct tcl_chan *ch = tcl_chan(tcl, argv[1]);
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
+    }
+    if (argc > 2 && tcl_int(argv[2]) < 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("read amount must not be negative", 32));
+    }
+    size_t want = (argc > 2 ? (size_t)tcl_int(argv[2]) : (size_t)-1);
+    if (argc == 2 && ch->driver->sized) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("read needs an amount on this channel", 36));
+    }
+    /* Whatever gets read ahead first, then the driver reads straight into
+     * the value, in steps that grow with it */
+    size_t n = ch->inlen - ch->inpos;
+    n = (n < want ? n : want);
+    tcl_value_t *text = tcl_reserve(NULL, n);
+    if (text == NULL) {
+        return tcl_no_memory(tcl);
+    }
+    if (n > 0) {
+        memcpy(text->str, ch->in + ch->inpos, n);
+    }
+    tcl_finalize(text, n);
+    ch->inpos += n;
+    while (text->len < want) {
+        size_t step = (text->len > ch->size ? text->len : ch->size);
+        step = (step < want - text->len ? step : want - text->len);
+        if ((text = tcl_reserve(text, step)) == NULL) {
+            return tcl_no_memory(tcl);
+        }
+        int got = ch->driver->read(ch->ctx, text->str + text->len, step);
+        if (got <= 0) {
+            break;
+        }
+        tcl_finalize(text, got);
+    }
     return tcl_result(tcl, TCL_OK, text);
 }
 
-static tcl_result_t tcl_cmd_open(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static tcl_result_t tcl_cmd_flush(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    struct tcl_chan *ch = tcl_chan(tcl, argv[1]);
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
+    }
+    if (tcl_chan_drain(ch) < 0) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("write failed", 12));
+    }
+    ch->driver->flush(ch->ctx);
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+static tcl_result_t tcl_cmd_fconfigure(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
-    tcl_value_t *filename = tcl_list_at(args, 1);
-    if (strcmp(filename, "/dev/serial") == 0 || strcmp(filename, "/dev/serial0") == 0) {
-        tcl_value_t *bauds = tcl_list_at(args, 2);
-        int baud = (int)tcl_num(bauds);
-        if (baud == 0) baud = 9600;
-        Serial.begin(baud);
-        tcl_free(bauds);
-        tcl_free(filename);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("\x11\x30", 2)); // \x30 is ASCII '0'
+    static const char *modes[] = {"full", "line", "none"};
+    struct tcl_chan *ch = (argc > 1 ? tcl_chan(tcl, argv[1]) : NULL);
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
     }
-#ifdef Serial1
-    if (strcmp(filename, "/dev/serial1") == 0) {
-        tcl_value_t *bauds = tcl_list_at(args, 2);
-        int baud = (int)tcl_num(bauds);
-        if (baud == 0) baud = 9600;
-        Serial1.begin(baud);
-        tcl_free(bauds);
-        tcl_free(filename);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("\x11\x31", 2)); // \x31 is ASCII '1'
+    if (argc == 2) {
+        char buf[48];
+        const char *mode = modes[ch->buffering == 'f' ? 0 : ch->buffering == 'l' ? 1 : 2];
+        return tcl_result(tcl, TCL_OK, tcl_alloc(buf, snprintf(buf, sizeof(buf), "-buffering %s -buffersize %lu", mode, (unsigned long)ch->size)));
     }
-#endif
-#ifdef Serial2
-    if (strcmp(filename, "/dev/serial2") == 0) {
-        tcl_value_t *bauds = tcl_list_at(args, 2);
-        int baud = (int)tcl_num(bauds);
-        if (baud == 0) baud = 9600;
-        Serial2.begin(baud);
-        tcl_free(bauds);
-        tcl_free(filename);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("\x11\x32", 2)); // \x32 is ASCII '2'
+    for (int i = 2; i < argc; i += 2) {
+        const char *opt = tcl_string(argv[i]);
+        const char *value = (i + 1 < argc ? tcl_string(argv[i + 1]) : "");
+        if (strcmp(opt, "-buffering") == 0 &&
+            (strcmp(value, "full") == 0 || strcmp(value, "line") == 0 || strcmp(value, "none") == 0)) {
+            ch->buffering = value[0];
+        } else if (strcmp(opt, "-buffersize") == 0 && i + 1 < argc && tcl_int(argv[i + 1]) > 0) {
+            /* The output buffer is allocated again at the new size */
+            tcl_chan_drain(ch);
+            tcl_mfree(ch->out);
+            ch->out = NULL;
+            ch->size = (size_t)tcl_int(argv[i + 1]);
+        } else {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("fconfigure channel ?-buffering full|line|none? ?-buffersize n?", 61));
+        }
     }
-#endif
-#ifdef Serial3
-    if (strcmp(filename, "/dev/serial3") == 0) {
-        tcl_value_t *bauds = tcl_list_at(args, 2);
-        int baud = (int)tcl_num(bauds);
-        if (baud == 0) baud = 9600;
-        Serial3.begin(baud);
-        tcl_free(bauds);
-        tcl_free(filename);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("\x11\x33", 2)); // \x33 is ASCII '3'
+    return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+}
+
+static tcl_result_t tcl_cmd_open(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg;
+    if (argc < 2) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("open name ?mode?", 16));
     }
-#endif
-    if (strcmp(filename, "/dev/spi") == 0) {
+    const char *filename = tcl_string(argv[1]);
+    int i = -1;
+    char name[16];
+    tcl_chans(tcl);
+    if (strncmp(filename, "/dev/serial", 11) == 0) {
+        unsigned int portnum = (filename[11] == '\0' ? 0 : filename[11] - '0');
+        if (portnum < sizeof(serials) / sizeof(serials[0]) && (filename[11] == '\0' || filename[12] == '\0')) {
+            int baud = (argc > 2 ? (int)tcl_int(argv[2]) : 0);
+            if (baud == 0) baud = 9600;
+            tcl_serial_begin(portnum, baud);
+            i = tcl_chan_open(tcl, &tcl_serial_driver, serials[portnum]);
+        }
+    } else if (strcmp(filename, "/dev/spi") == 0) {
         SPI.begin();
-        tcl_free(filename);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("\x12", 1));
-    }
-    // it's a filename
-    int mode = FILE_READ;
-    tcl_value_t *m = tcl_list_at(args, 2);
-    if (strcmp(m, "w") == 0) mode = FILE_WRITE;
-    tcl_free(m);
-    File f = SD.open(tcl_string(filename), mode);
-    if (!f) return tcl_result(tcl, TCL_ERROR, tcl_alloc("file not found", 14));
-    char out[5];
-    uintptr_t fp = &f;
-    out[0] = 0x1C;
-    memcpy(out + 1, &fp, 4); // 4 because 32-bits architecture
-    tcl_free(filename);
-    return tcl_result(tcl, TCL_OK, tcl_alloc(out, sizeof(out)));
-}
-
-static tcl_result_t tcl_cmd_close(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)arg;
-    tcl_value_t fd = tcl_list_at(args, 0);
-    if (fd[0] == 0x11 || fd[0] == 0x12) { // Serial ports can't be closed; SPI can but shouldn't (would mess up SD card)
-        tcl_free(fd);
-        return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
-    }
-    uintptr_t fp = (uintptr_t)*(fd + 1);
-    File f = (File)*fp;
-    f.close();
-    free(f);
-    tcl_free(fd);
+        i = tcl_chan_open(tcl, &tcl_spi_driver, NULL);
+    } else {
+        void *f = tcl_open_file(filename, argc > 2 ? tcl_string(argv[2]) : "r");
+        if (f == NULL) {
+            return tcl_result(tcl, TCL_ERROR, tcl_alloc("file not found", 14));
+        }
+        i = tcl_chan_open(tcl, &tcl_file_driver, f);
+    }
+    if (i < 0) {
+        return tcl_no_chan(tcl);
+    }
+    return tcl_result(tcl, TCL_OK, tcl_alloc(name, snprintf(name, sizeof(name), "chan%d", i)));
+}
+
+static tcl_result_t tcl_cmd_close(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    struct tcl_chan *ch = tcl_chan(tcl, argv[1]);
+    if (ch == NULL) {
+        return tcl_no_chan(tcl);
+    }
+    if (ch == tcl->chans) {
+        /* puts without a channel and the host's own output need it */
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("cannot close the standard channel", 33));
+    }
+    tcl_chan_close(ch);
     return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
 }
 
+static size_t tcl_chan_source(void *ctx, char *buf, size_t n) {
+    struct tcl_chan *ch = (struct tcl_chan *)ctx;
+    int got = ch->driver->read(ch->ctx, buf, n);
+    return (got < 0 ? 0 : (size_t)got);
+}
+
+/* Runs a script from a file a chunk at a time, see tcl_eval_stream() */
+static tcl_result_t tcl_cmd_source(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    struct tcl_chan ch;
+    ch.driver = &tcl_file_driver;
+    ch.ctx = tcl_open_file(tcl_string(argv[1]), "r");
+    if (ch.ctx == NULL) return tcl_result(tcl, TCL_ERROR, tcl_alloc("file not found", 14));
+    tcl_result_t r = tcl_eval_stream(tcl, tcl_chan_source, &ch);
+    ch.driver->close(ch.ctx);
+    return (r == TCL_RETURN ? TCL_OK : r);
+}
+
 void tcl_init_streams(struct tcl *tcl) {
     tcl_register(tcl, "puts", tcl_cmd_puts, 0);
+    tcl_register(tcl, "gets", tcl_cmd_gets, 0);
     tcl_register(tcl, "open", tcl_cmd_open, 0);
     tcl_register(tcl, "close", tcl_cmd_close, 2);
     tcl_register(tcl, "read", tcl_cmd_read, 0);
-}
\ No newline at end of file
+    tcl_register(tcl, "flush", tcl_cmd_flush, 2);
+    tcl_register(tcl, "fconfigure", tcl_cmd_fconfigure, 0);
+    tcl_register(tcl, "source", tcl_cmd_source, 2);
+}
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -5,7 +6,236 @@
 #ifndef TCL_H
 #define TCL_H
 
-#define MAX_VAR_LENGTH 256
+/* Compile proc, while and if bodies to bytecode (0 = always walk the text) */
+#ifndef TCL_COMPILE
+#define TCL_COMPILE 1
+#endif
+
+/* Bytes of scratch memory for building the words of a command, which are
+ * dropped all at once when it returns (0 = allocate every word on the heap) */
+#ifndef TCL_ARENA
+#define TCL_ARENA 1024
+#endif
+
+/* Strings that fit in this many bytes (with their NUL) are kept inside the
+ * value instead of in a heap block of their own */
+#ifndef TCL_INLINE
+#define TCL_INLINE 16
+#endif
+
+/* Let tcl_next() scan 16 or 32 bytes at a step with SSE2 or AVX2 where the
+ * compiler targets them, or a machine word at a time elsewhere (0 = a byte
+ * at a time, e.g. to check the fast paths against) */
+#ifndef TCL_SIMD
+#define TCL_SIMD 1
+#endif
+#if TCL_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if TCL_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Bytes read at a time by tcl_eval_stream() */
+#ifndef TCL_CHUNK
+#define TCL_CHUNK 128
+#endif
+/* Bytes of output a channel gathers before writing, see tcl_streams.h */
+#ifndef TCL_CHAN_BUFFER
+#define TCL_CHAN_BUFFER 128
+#endif
+/* Pin edges queued between the interrupt and the scripts watching for
+ * them, see pin watch (a power of two, 128 at most) */
+#ifndef TCL_WATCH_RING
+#define TCL_WATCH_RING 16
+#endif
+/* Files are the host's own rather than the SD card's (off on Arduino) */
+#ifndef TCL_POSIX
+#ifdef ARDUINO
+#define TCL_POSIX 0
+#else
+#define TCL_POSIX 1
+#endif
+#endif
+
+/* Calls may nest this deep before the script fails with "too many nested
+ * calls". Procs calling compiled procs only take a frame on the heap (some
+ * 100 bytes with the variables' frame), but other nesting (walked scripts,
+ * [...] outside of compiled code, commands running a script) recurses on
+ * the C stack, about 300 bytes a level, so that is held to TCL_MAX_NEST
+ * levels on its own to stay inside a small task stack. */
+#ifndef TCL_MAX_DEPTH
+#ifdef ARDUINO
+#define TCL_MAX_DEPTH 200
+#else
+#define TCL_MAX_DEPTH 10000
+#endif
+#endif
+#ifndef TCL_MAX_NEST
+#ifdef ARDUINO
+#define TCL_MAX_NEST 16
+#else
+#define TCL_MAX_NEST 1000
+#endif
+#endif
+
+/* Count calls, time and bytes allocated per command, see `info profile` */
+#ifndef TCL_PROFILE
+#define TCL_PROFILE 0
+#endif
+/* Record begin and end events of commands, procs and loop iterations in a
+ * ring of this many, for `info trace` (0 = not compiled in) */
+#ifndef TCL_TRACE
+#define TCL_TRACE 0
+#endif
+
+#if (TCL_PROFILE || TCL_TRACE) && defined(ARDUINO)
+#include <Arduino.h>
+#define TCL_TICKS_PER_US 1
+static unsigned long tcl_ticks() { return micros(); }
+#elif TCL_PROFILE || TCL_TRACE
+#include <time.h>
+#define TCL_TICKS_PER_US 1000
+static unsigned long tcl_ticks() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+/* Run interpreters on several threads at once, see tcl_pool.h (needs C++11
+ * threads, so 0 = single threaded) */
+#ifndef TCL_POOL
+#define TCL_POOL 0
+#endif
+#if TCL_POOL
+#define TCL_THREAD_LOCAL thread_local
+#else
+#define TCL_THREAD_LOCAL
+#endif
+
+/* Charge every allocation to the interpreter that made it, keeping current
+ * and peak bytes and live blocks, and enforce heap.limit (0 = plain malloc,
+ * which saves the header in front of each block) */
+#ifndef TCL_ACCOUNT
+#define TCL_ACCOUNT 1
+#endif
+
+/* Allocator hook, realloc() alike but freeing p when n is 0 */
+typedef void *(*tcl_alloc_fn_t)(void *ctx, void *p, size_t n);
+
+struct tcl_heap {
+    tcl_alloc_fn_t alloc;
+    void *ctx;
+    size_t bytes;  /* in use now, headers not included */
+    size_t peak;
+    size_t blocks; /* live allocations */
+    size_t limit;  /* the running command fails once bytes exceeds it, 0 = none */
+    int over;      /* the limit was crossed since the last check */
+};
+
+#if TCL_PROFILE
+static TCL_THREAD_LOCAL unsigned long tcl_allocated; /* bytes asked for so far, by this thread */
+#define tcl_count_alloc(n) (tcl_allocated += (n))
+#else
+#define tcl_count_alloc(n) ((void)0)
+#endif
+
+/* All interpreter memory comes from these */
+#if TCL_ACCOUNT
+static void *tcl_system_alloc(void *ctx, void *p, size_t n) {
+    (void)ctx;
+    if (n == 0) {
+        free(p);
+        return NULL;
+    }
+    return realloc(p, n);
+}
+
+/* Heap of the interpreter running on this thread, or of the one set up last */
+static TCL_THREAD_LOCAL struct tcl_heap *tcl_heap;
+
+/* In front of each block, so freeing it credits the right heap */
+union tcl_block {
+    struct {
+        struct tcl_heap *heap;
+        size_t size;
+    } h;
+    long long align;
+    double d;
+};
+
+/* NULL, with p left as it was, if the allocator fails or heap.limit could
+ * not hold the block even on its own. Smaller blocks are always given, and
+ * going over the limit with them fails the command afterwards. */
+static void *tcl_realloc(void *p, size_t n) {
+    union tcl_block *b = (p != NULL ? (union tcl_block *)p - 1 : NULL);
+    struct tcl_heap *heap = (b != NULL ? b->h.heap : tcl_heap);
+    size_t old = (b != NULL ? b->h.size : 0);
+    union tcl_block *nb;
+    tcl_count_alloc(n);
+    if (heap == NULL) {
+        nb = (union tcl_block *)realloc(b, sizeof(*b) + n);
+        if (nb == NULL) {
+            return NULL;
+        }
+        b = nb;
+    } else {
+        if (heap->limit != 0 && n > heap->limit) {
+            return NULL;
+        }
+        nb = (union tcl_block *)heap->alloc(heap->ctx, b, sizeof(*b) + n);
+        if (nb == NULL) {
+            return NULL;
+        }
+        b = nb;
+        heap->bytes += n - old;
+        heap->blocks += (p == NULL);
+        if (heap->bytes > heap->peak) {
+            heap->peak = heap->bytes;
+        }
+        if (heap->limit != 0 && heap->bytes > heap->limit) {
+            heap->over = 1;
+        }
+    }
+    b->h.heap = heap;
+    b->h.size = n;
+    return b + 1;
+}
+
+static void tcl_mfree(void *p) {
+    if (p != NULL) {
+        union tcl_block *b = (union tcl_block *)p - 1;
+        struct tcl_heap *heap = b->h.heap;
+        if (heap == NULL) {
+            free(b);
+        } else {
+            heap->bytes -= b->h.size;
+            heap->blocks--;
+            heap->alloc(heap->ctx, b, 0);
+        }
+    }
+}
+#else
+static void *tcl_realloc(void *p, size_t n) {
+    tcl_count_alloc(n);
+    return realloc(p, n);
+}
+
+static void tcl_mfree(void *p) {
+    free(p);
+}
+#endif
+
+static void *tcl_malloc(size_t n) {
+    return tcl_realloc(NULL, n);
+}
+
+static void *tcl_calloc(size_t n, size_t size) {
+    void *p = tcl_realloc(NULL, n * size);
+    memset(p, 0, n * size);
+    return p;
+}
 
 /* Token type and control flow constants */
 enum tcl_token { TOK_COMMAND, TOK_WORD, TOK_PART, TOK_ERROR };
@@ -24,6 +254,72 @@ static int tcl_is_end(char c) {
     return c == '\n' || c == '\r' || c == ';' || c == '\0';
 }
 
+/* How many leading bytes of s[0..n) are none of the nset (at most 12) bytes
+ * in set, or at least a safe lower bound of that: vector code finds the
+ * exact offset 16 or 32 bytes at a step, SWAR stops at the first word that
+ * may hold a match, and without either nothing is skipped */
+static size_t tcl_skip(const char *s, size_t n, const char *set, int nset) {
+    size_t i = 0;
+    int k;
+#if TCL_SIMD && defined(__AVX2__)
+    __m256i set32[12];
+    for (k = 0; k < nset; k++) {
+        set32[k] = _mm256_set1_epi8(set[k]);
+    }
+    for (; i + 32 <= n; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i m = _mm256_cmpeq_epi8(b, set32[0]);
+        for (k = 1; k < nset; k++) {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, set32[k]));
+        }
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(m);
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+#if TCL_SIMD && defined(__SSE2__)
+    __m128i set16[12];
+    for (k = 0; k < nset; k++) {
+        set16[k] = _mm_set1_epi8(set[k]);
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_cmpeq_epi8(b, set16[0]);
+        for (k = 1; k < nset; k++) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(b, set16[k]));
+        }
+        unsigned int bits = (unsigned int)_mm_movemask_epi8(m);
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#elif TCL_SIMD
+    /* A word holds a byte equal to c if word ^ c*ones has a zero byte */
+    const unsigned long ones = (unsigned long)-1 / 0xff;
+    for (; i + sizeof(ones) <= n; i += sizeof(ones)) {
+        unsigned long w, hit = 0;
+        memcpy(&w, s + i, sizeof(w));
+        for (k = 0; k < nset; k++) {
+            unsigned long x = w ^ (ones * (unsigned char)set[k]);
+            hit |= (x - ones) & ~x & (ones << 7);
+        }
+        if (hit != 0) {
+            break;
+        }
+    }
+#else
+    (void)s, (void)n, (void)set, (void)nset, (void)k;
+#endif
+    return i;
+}
+
+/* What ends a word, see tcl_is_special() and tcl_is_space() */
+static const char tcl_word_ends[2][12] = {
+    {'$', '{', '}', ';', '\r', '\n', '[', ']', '"', '\0', ' ', '\t'},
+    {'$', '[', ']', '"', '\0'},
+};
+
 tcl_token tcl_next(const char *s, size_t n, const char **from, const char **to, int *q) {
     unsigned int i = 0;
     int depth = 0;
@@ -33,14 +329,17 @@ tcl_token tcl_next(const char *s, size_t n, const char **from, const char **to,
     /* Skip leading spaces if not quoted */
     for (; !*q && n > 0 && tcl_is_space(*s); s++, n--) {
     }
-    *from = s;
+    *from = *to = s;
+    if (n == 0) {
+        return TOK_ERROR;
+    }
     /* Terminate command if not quoted */
-    if (!*q && n > 0 && tcl_is_end(*s)) {
+    if (!*q && tcl_is_end(*s)) {
         *to = s + 1;
         return TOK_COMMAND;
     }
     if (*s == '$') { /* Variable token, must not start with a space or quote */
-        if (tcl_is_space(s[1]) || s[1] == '"') {
+        if (n < 2 || tcl_is_space(s[1]) || s[1] == '"') {
             return TOK_ERROR;
         }
         int mode = *q;
@@ -54,8 +353,14 @@ tcl_token tcl_next(const char *s, size_t n, const char **from, const char **to,
         /* Interleaving pairs are not welcome, but it simplifies the code */
         open = *s;
         close = (open == '[' ? ']' : '}');
-        for (i = 0, depth = 1; i < n && depth != 0; i++) {
-            if (i > 0 && s[i] == open) {
+        const char pair[2] = {open, close};
+        for (i = 1, depth = 1; i < n && depth != 0; i++) {
+            /* Jump over whatever is neither brace (or bracket) */
+            i += tcl_skip(s + i, n - i, pair, 2);
+            if (i == n) {
+                break;
+            }
+            if (s[i] == open) {
                 depth++;
             } else if (s[i] == close) {
                 depth--;
@@ -76,8 +381,11 @@ tcl_token tcl_next(const char *s, size_t n, const char **from, const char **to,
         /* Unbalanced bracket or brace */
         return TOK_ERROR;
     } else {
+        /* Most words are short, long ones (quoted text) are skipped over */
         while (i < n && (*q || !tcl_is_space(s[i])) && !tcl_is_special(s[i], *q)) {
-            i++;
+            if (++i == 16) {
+                i += tcl_skip(s + i, n - i, tcl_word_ends[*q != 0], *q ? 5 : 12);
+            }
         }
     }
     *to = s + i;
@@ -108,24 +416,345 @@ struct tcl_parser {
             (skiperr));                                                        \
         p.start = p.to)
 
+/* Incremental reader for input that arrives in pieces, such as a serial
+ * console. Bytes are fed as they come and each is scanned once: the reader
+ * keeps the quote, brace and bracket state that tcl_next() would have at the
+ * end of the buffer, and notes where the last complete command ends. */
+struct tcl_reader {
+    char *buf;
+    size_t len;   /* bytes buffered */
+    size_t cap;
+    size_t scan;  /* bytes scanned so far */
+    size_t ready; /* the commands before this offset are complete */
+    int q;        /* inside quotes */
+    char open;    /* '{' or '[' while inside such a run, 0 otherwise */
+    int depth;    /* nesting of the open run */
+};
+
+void tcl_reader_init(struct tcl_reader *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+void tcl_reader_free(struct tcl_reader *r) {
+    tcl_mfree(r->buf);
+    tcl_reader_init(r);
+}
+
+/* Makes room for n more bytes of input and returns where they go, for
+ * reading straight into the buffer; tcl_reader_commit() then takes them */
+char *tcl_reader_reserve(struct tcl_reader *r, size_t n) {
+    if (r->len + n > r->cap) {
+        r->cap = (r->cap < 64 ? 64 : 2 * r->cap);
+        if (r->cap < r->len + n) {
+            r->cap = r->len + n;
+        }
+        r->buf = (char *)tcl_realloc(r->buf, r->cap);
+    }
+    return r->buf + r->len;
+}
+
+/* Takes n reserved bytes as input, returns nonzero once a complete command
+ * is buffered */
+int tcl_reader_commit(struct tcl_reader *r, size_t n) {
+    r->len += n;
+    for (; r->scan < r->len; r->scan++) {
+        char c = r->buf[r->scan];
+        if (r->open != 0) {
+            if (c == r->open) {
+                r->depth++;
+            } else if (c == (r->open == '{' ? '}' : ']') && --r->depth == 0) {
+                r->open = 0;
+            }
+        } else if (c == '[' || (c == '{' && !r->q)) {
+            r->open = c;
+            r->depth = 1;
+        } else if (c == '"') {
+            r->q = !r->q;
+        } else if (!r->q && tcl_is_end(c)) {
+            r->ready = r->scan + 1;
+        }
+    }
+    return r->ready > 0;
+}
+
+int tcl_reader_feed(struct tcl_reader *r, const char *s, size_t n) {
+    memcpy(tcl_reader_reserve(r, n), s, n);
+    return tcl_reader_commit(r, n);
+}
+
+/* Evaluates the complete commands and drops them from the buffer, keeping
+ * any partial one */
+tcl_result_t tcl_reader_eval(struct tcl *tcl, struct tcl_reader *r) {
+    tcl_result_t res = tcl_eval(tcl, r->buf, r->ready);
+    memmove(r->buf, r->buf + r->ready, r->len - r->ready);
+    r->len -= r->ready;
+    r->scan -= r->ready;
+    r->ready = 0;
+    return res;
+}
+
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
-typedef char tcl_value_t;
+/* Values are reference counted and keep two forms of the same thing: the
+ * string, and a cached native form so numbers and lists are not parsed again
+ * on every use. Either may be missing, but never both: a computed number has no
+ * string until someone asks for it, and a string is only parsed when read as
+ * a number. Values are shared by tcl_dup(), so anything that mutates one
+ * (tcl_append and friends) copies it first if it is shared. */
+enum tcl_type { TCL_NONE, TCL_INT, TCL_DOUBLE, TCL_LIST, TCL_EXPR };
+struct tcl_expr;
+
+struct tcl_list {
+    int len;
+    int cap;
+    struct tcl_value **items;
+};
+
+typedef struct tcl_value {
+    int refs;
+    short type;  /* which native form is cached, if any */
+    short arena; /* lives in the scratch arena, see tcl_dup() */
+    char *str;
+    size_t len;
+    size_t cap; /* bytes allocated for str, so appends can grow in place */
+    union {
+        long long i;
+        double d;
+        struct tcl_list *list;
+        struct tcl_expr *expr; /* parsed by tcl_expr.h */
+    } rep;
+    char small[TCL_INLINE]; /* str points here for short strings */
+} tcl_value_t;
+
+void tcl_free(tcl_value_t *v);
+static void tcl_list_to_string(tcl_value_t *v);
+static void tcl_expr_free(struct tcl_expr *e);
+
+/* Drops the native form, the string must be there already */
+static void tcl_rep_free(tcl_value_t *v) {
+    if (v->type == TCL_LIST) {
+        struct tcl_list *l = v->rep.list;
+        for (int i = 0; i < l->len; i++) {
+            tcl_free(l->items[i]);
+        }
+        tcl_mfree(l->items);
+        tcl_mfree(l);
+    } else if (v->type == TCL_EXPR) {
+        tcl_expr_free(v->rep.expr);
+    }
+    v->type = TCL_NONE;
+}
+
+/* Gives v room for a string of cap bytes, inline if it is small enough.
+ * Returns 0, leaving v without a string, if there is no memory for it. */
+static int tcl_str_alloc(tcl_value_t *v, size_t cap) {
+    if (cap <= TCL_INLINE) {
+        v->str = v->small;
+        v->cap = TCL_INLINE;
+    } else {
+        v->str = (char *)tcl_malloc(cap);
+        v->cap = (v->str != NULL ? cap : 0);
+    }
+    return v->str != NULL;
+}
+
+static void tcl_str_free(tcl_value_t *v) {
+    if (v->str != v->small) {
+        tcl_mfree(v->str);
+    }
+}
+
+static tcl_value_t *tcl_value_new(int type) {
+    tcl_value_t *v = (tcl_value_t *)tcl_malloc(sizeof(*v));
+    v->refs = 1;
+    v->type = type;
+    v->arena = 0;
+    v->str = NULL;
+    v->len = 0;
+    v->cap = 0;
+    return v;
+}
+
+/* Formats an integer without pulling printf's long long support in */
+static size_t tcl_format_int(char *buf, long long i) {
+    char tmp[24];
+    size_t n = 0, len = 0;
+    unsigned long long u = i < 0 ? 0ULL - (unsigned long long)i : (unsigned long long)i;
+    do {
+        tmp[n++] = '0' + (char)(u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (i < 0) {
+        buf[len++] = '-';
+    }
+    while (n > 0) {
+        buf[len++] = tmp[--n];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+const char *tcl_string(tcl_value_t *v) {
+    if (v->str == NULL && v->type == TCL_LIST) {
+        tcl_list_to_string(v);
+    } else if (v->str == NULL) {
+        char buf[64];
+        if (v->type == TCL_INT) {
+            v->len = tcl_format_int(buf, v->rep.i);
+        } else {
+            v->len = snprintf(buf, sizeof(buf), "%f", v->rep.d);
+        }
+        tcl_str_alloc(v, v->len + 1);
+        memcpy(v->str, buf, v->len + 1);
+    }
+    return v->str;
+}
+
+int tcl_length(tcl_value_t *v) {
+    if (v == NULL) {
+        return 0;
+    }
+    tcl_string(v);
+    return v->len;
+}
+
+/* Orders two strings byte by byte like strcmp(), NULs included */
+int tcl_compare(tcl_value_t *a, tcl_value_t *b) {
+    size_t n = tcl_length(a), m = tcl_length(b);
+    int cmp = memcmp(tcl_string(a), tcl_string(b), n < m ? n : m);
+    return (cmp != 0 ? cmp : (n > m) - (n < m));
+}
+
+/* Caches the native form of a string, integer if it is one exactly */
+static void tcl_parse_num(tcl_value_t *v) {
+    char *end;
+    tcl_string(v);
+    tcl_rep_free(v);
+    long long i = strtoll(v->str, &end, 10);
+    if (end != v->str && end == v->str + v->len) {
+        v->type = TCL_INT;
+        v->rep.i = i;
+        return;
+    }
+    double d = strtod(v->str, &end);
+    v->type = TCL_DOUBLE;
+    v->rep.d = (end == v->str ? 0 : d);
+}
+
+double tcl_double(tcl_value_t *v) {
+    if (v->type != TCL_INT && v->type != TCL_DOUBLE) {
+        tcl_parse_num(v);
+    }
+    return v->type == TCL_INT ? (double)v->rep.i : v->rep.d;
+}
+
+long long tcl_int(tcl_value_t *v) {
+    if (v->type != TCL_INT && v->type != TCL_DOUBLE) {
+        tcl_parse_num(v);
+    }
+    return v->type == TCL_INT ? v->rep.i : (long long)v->rep.d;
+}
+
+float tcl_num(tcl_value_t *v) { return (float)tcl_double(v); }
+
+tcl_value_t *tcl_alloc_int(long long i) {
+    tcl_value_t *v = tcl_value_new(TCL_INT);
+    v->rep.i = i;
+    return v;
+}
+
+tcl_value_t *tcl_alloc_double(double d) {
+    tcl_value_t *v = tcl_value_new(TCL_DOUBLE);
+    v->rep.d = d;
+    return v;
+}
+
+void tcl_free(tcl_value_t *v) {
+    if (v != NULL && --v->refs == 0) {
+        tcl_rep_free(v);
+        if (!v->arena) {
+            tcl_str_free(v);
+            tcl_mfree(v);
+        }
+    }
+}
 
-const char *tcl_string(tcl_value_t *v) { return v; }
-float tcl_num(tcl_value_t *v) { float x; sscanf(v, "%f", &x); return x; }
-int tcl_length(tcl_value_t *v) { return v == NULL ? 0 : strlen(v); }
+/* Makes room for n more bytes after the string of v, copying it first if it
+ * is shared. The caller writes them at tcl_string(v) + tcl_length(v) and then
+ * calls tcl_finalize(). The buffer at least doubles when it has to grow, so
+ * building a string piece by piece costs amortized linear time. If there is
+ * no memory for it, v is released and NULL returned, see tcl_no_memory(). */
+tcl_value_t *tcl_reserve(tcl_value_t *v, size_t n) {
+    size_t need;
+    if (v == NULL) {
+        v = tcl_value_new(TCL_NONE);
+    } else if (v->refs > 1 || v->arena) {
+        tcl_value_t *copy = tcl_value_new(TCL_NONE);
+        copy->len = tcl_length(v);
+        if (n > (size_t)-1 - copy->len - 1 || !tcl_str_alloc(copy, copy->len + n + 1)) {
+            copy->len = 0;
+            tcl_free(copy);
+            tcl_free(v);
+            return NULL;
+        }
+        memcpy(copy->str, v->str, copy->len);
+        tcl_free(v);
+        return copy;
+    } else {
+        tcl_string(v);
+    }
+    if (n > (size_t)-1 - v->len - 1) {
+        tcl_free(v);
+        return NULL;
+    }
+    need = v->len + n + 1;
+    if (v->str == NULL) {
+        if (!tcl_str_alloc(v, need)) {
+            tcl_free(v);
+            return NULL;
+        }
+    } else if (need > v->cap) {
+        size_t cap = (v->cap < 16 ? 16 : v->cap * 2);
+        cap = (cap < need ? need : cap);
+        char *old = (v->str == v->small ? NULL : v->str);
+        char *str = (char *)tcl_realloc(old, cap);
+        if (str == NULL && cap > need) {
+            /* Doubling may be what goes past the limit */
+            str = (char *)tcl_realloc(old, cap = need);
+        }
+        if (str == NULL) {
+            tcl_free(v);
+            return NULL;
+        }
+        if (old == NULL) {
+            memcpy(str, v->small, v->len);
+        }
+        v->str = str;
+        v->cap = cap;
+    }
+    return v;
+}
 
-void tcl_free(tcl_value_t *v) { free(v); }
+/* Takes n bytes written after a tcl_reserve() as part of the string,
+ * dropping the native form since it no longer matches */
+void tcl_finalize(tcl_value_t *v, size_t n) {
+    tcl_rep_free(v);
+    v->len += n;
+    v->str[v->len] = '\0';
+}
 
+/* Appends len bytes of s, which may be any bytes at all, NULs included.
+ * NULL if there is no memory for it, as with tcl_reserve(). */
 tcl_value_t *tcl_append_string(tcl_value_t *v, const char *s, size_t len) {
-    size_t n = tcl_length(v);
-    v = realloc(v, n + len + 1);
-    memset((char *)tcl_string(v) + n, 0, len + 1);
-    strncpy((char *)tcl_string(v) + n, s, len);
+    v = tcl_reserve(v, len);
+    if (v == NULL) {
+        return NULL;
+    }
+    memcpy(v->str + v->len, s, len);
+    tcl_finalize(v, len);
     return v;
 }
 
@@ -139,63 +768,138 @@ tcl_value_t *tcl_alloc(const char *s, size_t len) {
     return tcl_append_string(NULL, s, len);
 }
 
+/* Takes another reference to v. A word in the scratch arena is gone once
+ * its command returns, so whoever keeps one gets a copy on the heap. */
 tcl_value_t *tcl_dup(tcl_value_t *v) {
-    return tcl_alloc(tcl_string(v), tcl_length(v));
+    if (v == NULL) {
+        return tcl_alloc("", 0);
+    }
+    if (v->arena) {
+        tcl_value_t *copy = tcl_alloc(v->str, v->len);
+        if (v->type == TCL_INT || v->type == TCL_DOUBLE) {
+            copy->type = v->type;
+            copy->rep = v->rep;
+        }
+        return copy;
+    }
+    v->refs++;
+    return v;
 }
 
-tcl_value_t *tcl_list_alloc() { return tcl_alloc("", 0); }
+/* Trades a reference for one that outlives the current command */
+tcl_value_t *tcl_keep(tcl_value_t *v) {
+    if (v != NULL && v->arena) {
+        tcl_value_t *copy = tcl_dup(v);
+        tcl_free(v);
+        return copy;
+    }
+    return v;
+}
 
-int tcl_list_length(tcl_value_t *v) {
-    int count = 0;
-    tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
-        if (p.token == TOK_WORD) {
-            count++;
-        }
+/* Lists keep their elements in an array, so indexing is O(1) and appending
+ * is amortized O(1). A string is parsed into the array once, on first use as
+ * a list, and the string of a list is only built when it is asked for. */
+static void tcl_list_push(struct tcl_list *l, tcl_value_t *item) {
+    if (l->len == l->cap) {
+        l->cap = (l->cap == 0 ? 4 : 2 * l->cap);
+        l->items = (tcl_value_t **)tcl_realloc(l->items, l->cap * sizeof(*l->items));
     }
-    return count;
+    l->items[l->len++] = item;
 }
 
-void tcl_list_free(tcl_value_t *v) { free(v); }
+tcl_value_t *tcl_list_alloc() {
+    tcl_value_t *v = tcl_value_new(TCL_LIST);
+    v->rep.list = (struct tcl_list *)tcl_calloc(1, sizeof(struct tcl_list));
+    return v;
+}
 
-tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
-    int i = 0;
-    tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
-        if (p.token == TOK_WORD) {
-            if (i == index) {
+static struct tcl_list *tcl_to_list(tcl_value_t *v) {
+    if (v->type != TCL_LIST) {
+        struct tcl_list *l = (struct tcl_list *)tcl_calloc(1, sizeof(*l));
+        tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
+            if (p.token == TOK_WORD) {
                 if (p.from[0] == '{') {
-                    return tcl_alloc(p.from + 1, p.to - p.from - 2);
+                    tcl_list_push(l, tcl_alloc(p.from + 1, p.to - p.from - 2));
+                } else {
+                    tcl_list_push(l, tcl_alloc(p.from, p.to - p.from));
                 }
-                return tcl_alloc(p.from, p.to - p.from);
             }
-            i++;
         }
+        tcl_rep_free(v);
+        v->type = TCL_LIST;
+        v->rep.list = l;
     }
-    return NULL;
+    return v->rep.list;
 }
 
-tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
-    if (tcl_length(v) > 0) {
-        v = tcl_append(v, tcl_alloc(" ", 2));
-    }
-    if (tcl_length(tail) > 0) {
-        bool q = false;
-        const char *p;
-        for (p = tcl_string(tail); *p; p++) {
-            if (tcl_is_space(*p) || tcl_is_special(*p, 0)) {
-                q = true;
-                break;
-            }
+static int tcl_list_quoted(tcl_value_t *item) {
+    const char *p = tcl_string(item), *end = p + item->len;
+    if (item->len == 0) {
+        return 1;
+    }
+    for (; p < end; p++) {
+        if (tcl_is_space(*p) || tcl_is_special(*p, 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tcl_list_to_string(tcl_value_t *v) {
+    struct tcl_list *l = v->rep.list;
+    size_t n = 0;
+    int i;
+    for (i = 0; i < l->len; i++) {
+        n += tcl_length(l->items[i]) + 3;
+    }
+    tcl_str_alloc(v, n + 1);
+    v->len = 0;
+    for (i = 0; i < l->len; i++) {
+        tcl_value_t *item = l->items[i];
+        int q = tcl_list_quoted(item);
+        if (i > 0) {
+            v->str[v->len++] = ' ';
         }
         if (q) {
-            v = tcl_append(v, tcl_alloc("{", 1));
+            v->str[v->len++] = '{';
         }
-        v = tcl_append(v, tcl_dup(tail));
+        memcpy(v->str + v->len, item->str, item->len);
+        v->len += item->len;
         if (q) {
-            v = tcl_append(v, tcl_alloc("}", 1));
+            v->str[v->len++] = '}';
         }
-    } else {
-        v = tcl_append(v, tcl_alloc("{}", 2));
     }
+    v->str[v->len] = '\0';
+}
+
+int tcl_list_length(tcl_value_t *v) { return tcl_to_list(v)->len; }
+
+void tcl_list_free(tcl_value_t *v) { tcl_free(v); }
+
+tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
+    struct tcl_list *l = tcl_to_list(v);
+    if (index < 0 || index >= l->len) {
+        return NULL;
+    }
+    return tcl_dup(l->items[index]);
+}
+
+tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
+    struct tcl_list *l = tcl_to_list(v);
+    if (v->refs > 1 || v->arena) {
+        tcl_value_t *copy = tcl_list_alloc();
+        for (int i = 0; i < l->len; i++) {
+            tcl_list_push(copy->rep.list, tcl_dup(l->items[i]));
+        }
+        tcl_free(v);
+        v = copy;
+        l = v->rep.list;
+    }
+    /* The string goes stale, it is rebuilt when someone reads it */
+    tcl_str_free(v);
+    v->str = NULL;
+    v->len = 0;
+    tcl_list_push(l, tcl_dup(tail));
     return v;
 }
 
@@ -204,78 +908,259 @@ tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
 /* ----------------------------- */
 /* ----------------------------- */
 
-typedef tcl_result_t (*tcl_cmd_fn_t)(struct tcl *, tcl_value_t *, void *);
+/* Commands get their words as argv[0..argc), argv[0] being the name. The
+ * words belong to the caller, a command that keeps one must tcl_dup() it. */
+typedef tcl_result_t (*tcl_cmd_fn_t)(struct tcl *, int, tcl_value_t **, void *);
+typedef void (*tcl_cmd_free_fn_t)(void *);
+
+#if TCL_PROFILE
+/* What a command has cost so far, times in tcl_ticks() */
+struct tcl_prof {
+    unsigned long calls;
+    unsigned long long incl;  /* time inside the command */
+    unsigned long long excl;  /* the same, less the commands it called */
+    unsigned long long bytes; /* allocated while inside, callees included */
+};
+#endif
 
 struct tcl_cmd {
     tcl_value_t *name;
+    unsigned int hash;
     int arity;
     tcl_cmd_fn_t fn;
     void *arg;
-    struct tcl_cmd *next;
+    tcl_cmd_free_fn_t cleanup; /* releases arg, plain tcl_mfree() if NULL */
+    struct tcl_cmd *next; /* next in the same hash bucket */
+#if TCL_PROFILE
+    struct tcl_prof prof;
+#endif
 };
 
 struct tcl_var {
     tcl_value_t *name;
     tcl_value_t *value;
+    unsigned long writes; /* how often it was set, for vwait */
     struct tcl_var *next;
 };
 
-struct tcl_env {
-    struct tcl_var *vars;
-    struct tcl_env *parent;
+/* A proc keeps its parameters, body and the body compiled at definition.
+ * Parameters and the locals the compiler can see get fixed slots in the call
+ * frame, numbered in the order of locals[]. It is reference counted so that
+ * redefining a running proc is safe. */
+struct tcl_proc {
+    int refs;
+    tcl_value_t *params;
+    tcl_value_t *body;
+    struct tcl_code *code;
+    tcl_value_t **locals; /* parameters first */
+    int nparams;
+    int nlocals;
 };
 
-static struct tcl_env *tcl_env_alloc(struct tcl_env *parent) {
-    struct tcl_env *env = malloc(sizeof(*env));
-    env->vars = NULL;
-    env->parent = parent;
-    return env;
+/* Finds the slot of a local, -1 if it has none */
+static int tcl_local_find(struct tcl_proc *proc, const char *name, size_t len) {
+    for (int i = 0; i < proc->nlocals; i++) {
+        if (proc->locals[i]->len == len && memcmp(proc->locals[i]->str, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-static struct tcl_var *tcl_env_var(struct tcl_env *env, tcl_value_t *name) {
-    struct tcl_var *var = malloc(sizeof(struct tcl_var));
-    var->name = tcl_dup(name);
+/* Call frame. Frames are recycled through tcl->frames rather than freed,
+ * so a call normally allocates nothing. */
+struct tcl_env {
+    struct tcl_var *vars;  /* variables without a slot */
+    tcl_value_t **slots;   /* values of proc->locals, NULL until set */
+    int slotslen;
+    struct tcl_proc *proc; /* NULL at top level */
+    struct tcl_env *parent;
+};
+
+static struct tcl_var *tcl_env_var(struct tcl_env *env, const char *name, size_t len) {
+    struct tcl_var *var = (struct tcl_var *)tcl_malloc(sizeof(struct tcl_var));
+    var->name = tcl_alloc(name, len);
     var->next = env->vars;
     var->value = tcl_alloc("", 0);
+    var->writes = 0;
     env->vars = var;
     return var;
 }
 
-static struct tcl_env *tcl_env_free(struct tcl_env *env) {
-    struct tcl_env *parent = env->parent;
-    while (env->vars) {
-        struct tcl_var *var = env->vars;
-        env->vars = env->vars->next;
-        tcl_free(var->name);
-        tcl_free(var->value);
-        free(var);
+/* Value of slot i, set to v if v is not NULL */
+static tcl_value_t *tcl_env_slot(struct tcl_env *env, int i, tcl_value_t *v) {
+    if (v != NULL) {
+        tcl_free(env->slots[i]);
+        env->slots[i] = v;
+    } else if (env->slots[i] == NULL) {
+        env->slots[i] = tcl_alloc("", 0);
     }
-    free(env);
-    return parent;
+    return env->slots[i];
 }
 
+#if TCL_TRACE
+/* Nesting depth up to which loop iterations are numbered */
+#define TCL_TRACE_DEPTH 32
+
+struct tcl_event {
+    unsigned long t; /* tcl_ticks() */
+    const char *name;
+    long iter; /* which iteration of its loop, from 0, or -1 */
+    char ph;   /* 'B'egin or 'E'nd */
+    char cat;  /* 'c'ommand, 'p'roc or 'l'oop iteration */
+    short depth;
+};
+
+/* Events go round a fixed ring, so recording never allocates */
+struct tcl_trace {
+    struct tcl_event ring[TCL_TRACE];
+    unsigned long n; /* recorded so far, the last TCL_TRACE are kept */
+    int on;
+    int depth;
+    /* Loop that last iterated at each depth, and how often so far */
+    const void *loop[TCL_TRACE_DEPTH];
+    long iter[TCL_TRACE_DEPTH];
+};
+#endif
+
+/* A proc call that tcl_exec() runs in place, and what it interrupted. The
+ * profiler and tracer keep their per call state here for every call. */
+struct tcl_frame {
+    struct tcl_cmd *cmd;
+    struct tcl_proc *proc; /* the one called, even if cmd is redefined meanwhile */
+    struct tcl_code *code; /* the caller's, resumed at pc */
+    int pc;
+    int base; /* the caller's stack base and arena mark */
+    size_t mark;
+#if TCL_TRACE
+    int depth;
+#endif
+#if TCL_PROFILE
+    unsigned long long outer;
+    unsigned long bytes;
+    unsigned long start;
+#endif
+};
+
 struct tcl {
     struct tcl_env *env;
-    struct tcl_cmd *cmds;
+    struct tcl_cmd **cmds; /* hash buckets, a power of two of them */
+    const struct tcl *shared; /* where commands not defined here come from */
+    int ncmds;
+    int cmdslen;
+    unsigned int epoch; /* bumped whenever a command is (re)defined */
+    struct tcl_env *frames; /* released frames, ready for reuse */
     tcl_value_t *result;
+    tcl_value_t **stack; /* operand stack shared by nested bytecode runs */
+    int sp;
+    int stacklen;
+    struct tcl_frame *calls; /* procs running inside tcl_exec() */
+    int ncalls;
+    int callslen;
+    int nest; /* tcl_eval() and tcl_exec() running, one inside the other */
+    int compile; /* nonzero to compile bodies, zero to walk the text */
+    char *arena; /* TCL_ARENA bytes of scratch, see tcl_arena_alloc() */
+    size_t arenatop;
+    struct tcl_wheel *wheel; /* timers of the event loop, see tcl_after.h */
+    struct tcl_chan *chans;  /* open channels, see tcl_streams.h */
+    int nchans;
+#if TCL_PROFILE
+    unsigned long long callees; /* time spent in commands the running one called */
+#endif
+#if TCL_ACCOUNT
+    struct tcl_heap heap;
+#endif
+#if TCL_TRACE
+    struct tcl_trace trace;
+#endif
 };
 
-tcl_value_t *tcl_var(struct tcl *tcl, tcl_value_t *name, tcl_value_t *v) {
+static void tcl_env_push(struct tcl *tcl, struct tcl_proc *proc) {
+    struct tcl_env *env = tcl->frames;
+    int n = (proc != NULL ? proc->nlocals : 0);
+    if (env != NULL) {
+        tcl->frames = env->parent;
+    } else {
+        env = (struct tcl_env *)tcl_calloc(1, sizeof(*env));
+    }
+    if (env->slotslen < n) {
+        env->slotslen = n;
+        env->slots = (tcl_value_t **)tcl_realloc(env->slots, n * sizeof(*env->slots));
+    }
+    if (n > 0) {
+        memset(env->slots, 0, n * sizeof(*env->slots));
+    }
+    env->vars = NULL;
+    env->proc = proc;
+    env->parent = tcl->env;
+    tcl->env = env;
+}
+
+static void tcl_env_pop(struct tcl *tcl) {
+    struct tcl_env *env = tcl->env;
+    for (int i = 0; env->proc != NULL && i < env->proc->nlocals; i++) {
+        tcl_free(env->slots[i]);
+    }
+    while (env->vars) {
+        struct tcl_var *var = env->vars;
+        env->vars = env->vars->next;
+        tcl_free(var->name);
+        tcl_free(var->value);
+        tcl_mfree(var);
+    }
+    tcl->env = env->parent;
+    env->parent = tcl->frames;
+    tcl->frames = env;
+}
+
+/* The variable of env without a slot, NULL if it has not been set */
+static struct tcl_var *tcl_env_find(struct tcl_env *env, const char *name, size_t len) {
     struct tcl_var *var;
-    for (var = tcl->env->vars; var != NULL; var = var->next) {
-        if (strcmp(var->name, tcl_string(name)) == 0) {
+    for (var = env->vars; var != NULL; var = var->next) {
+        if (var->name->len == len && memcmp(var->name->str, name, len) == 0) {
             break;
         }
     }
+    return var;
+}
+
+/* Where the variable is kept in the current frame, created empty if missing.
+ * write is nonzero if the caller is about to store to it. */
+static tcl_value_t **tcl_var_ref(struct tcl *tcl, const char *name, size_t len, int write) {
+    struct tcl_var *var;
+    if (tcl->env->proc != NULL) {
+        int i = tcl_local_find(tcl->env->proc, name, len);
+        if (i >= 0) {
+            tcl_env_slot(tcl->env, i, NULL);
+            return &tcl->env->slots[i];
+        }
+    }
+    var = tcl_env_find(tcl->env, name, len);
     if (var == NULL) {
-        var = tcl_env_var(tcl->env, name);
+        var = tcl_env_var(tcl->env, name, len);
+    }
+    var->writes += (write != 0);
+    return &var->value;
+}
+
+tcl_value_t *tcl_var_string(struct tcl *tcl, const char *name, size_t len, tcl_value_t *v) {
+    tcl_value_t **ref;
+    if (v != NULL && tcl->env->proc != NULL) {
+        int i = tcl_local_find(tcl->env->proc, name, len);
+        if (i >= 0) {
+            return tcl_env_slot(tcl->env, i, v);
+        }
     }
+    ref = tcl_var_ref(tcl, name, len, v != NULL);
     if (v != NULL) {
-        tcl_free(var->value);
-        var->value = tcl_dup(v);
-        tcl_free(v);
+        tcl_free(*ref);
+        *ref = v;
     }
-    return var->value;
+    return *ref;
+}
+
+tcl_value_t *tcl_var(struct tcl *tcl, tcl_value_t *name, tcl_value_t *v) {
+    return tcl_var_string(tcl, tcl_string(name), tcl_length(name), v);
 }
 
 tcl_result_t tcl_result(struct tcl *tcl, tcl_result_t flow, tcl_value_t *result) {
@@ -284,6 +1169,63 @@ tcl_result_t tcl_result(struct tcl *tcl, tcl_result_t flow, tcl_value_t *result)
     return flow;
 }
 
+/* The error of a command whose value did not fit, see tcl_reserve() */
+static tcl_result_t tcl_no_memory(struct tcl *tcl) {
+    return tcl_result(tcl, TCL_ERROR, tcl_alloc("memory limit exceeded", 21));
+}
+
+/* The words of a command are built in a bump arena rather than with a malloc
+ * each. tcl_eval() and tcl_exec() note tcl->arenatop before a command and
+ * reset it after, which frees everything the command's words used. Nothing
+ * there may outlive that: tcl_dup() and tcl_keep() copy arena values to the
+ * heap, and commands already dup whatever they keep. */
+static void *tcl_arena_alloc(struct tcl *tcl, size_t n) {
+    size_t at = (tcl->arenatop + 7) & ~(size_t)7;
+    if (tcl->arena == NULL || at + n > TCL_ARENA) {
+        return NULL;
+    }
+    tcl->arenatop = at + n;
+    return tcl->arena + at;
+}
+
+/* An empty word with room for n bytes in the arena, NULL if it is full. The
+ * bytes start at w->small and run on past the header as far as needed. */
+static tcl_value_t *tcl_word_new(struct tcl *tcl, size_t n) {
+    size_t size = offsetof(tcl_value_t, small) + n + 1;
+    tcl_value_t *w;
+    if (size < sizeof(*w)) {
+        size = sizeof(*w);
+    }
+    w = (tcl_value_t *)tcl_arena_alloc(tcl, size);
+    if (w != NULL) {
+        w->refs = 1;
+        w->type = TCL_NONE;
+        w->arena = 1;
+        w->str = w->small;
+        w->str[0] = '\0';
+        w->len = 0;
+        w->cap = size - offsetof(tcl_value_t, small);
+    }
+    return w;
+}
+
+/* Appends to a word under construction (NULL to start one). It stays in the
+ * arena while it is the last thing there and fits, else moves to the heap. */
+static tcl_value_t *tcl_word_append(struct tcl *tcl, tcl_value_t *w, const char *s, size_t len) {
+    if (w == NULL) {
+        w = tcl_word_new(tcl, len);
+    } else if (w->arena && w->str + w->cap == tcl->arena + tcl->arenatop && tcl->arenatop + len <= TCL_ARENA) {
+        tcl->arenatop += len;
+        w->cap += len;
+    }
+    if (w == NULL || !w->arena || w->len + len + 1 > w->cap) {
+        return tcl_append_string(w, s, len);
+    }
+    memcpy(w->str + w->len, s, len);
+    tcl_finalize(w, len);
+    return w;
+}
+
 tcl_result_t tcl_subst(struct tcl *tcl, const char *s, size_t len) {
     if (len == 0) {
         return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
@@ -295,17 +1237,33 @@ tcl_result_t tcl_subst(struct tcl *tcl, const char *s, size_t len) {
             }
             return tcl_result(tcl, TCL_OK, tcl_alloc(s + 1, len - 2));
         case '$': {
-            if (len >= MAX_VAR_LENGTH) {
-                return tcl_result(tcl, TCL_ERROR, tcl_alloc("too long", 8));
+            /* $name and ${name} read the variable directly; $[cmd] and $$var
+             * substitute the name first */
+            const char *name = s + 1;
+            size_t n = len - 1;
+            if (n > 0 && (name[0] == '[' || name[0] == '$')) {
+                tcl_result_t r = tcl_subst(tcl, name, n);
+                if (r != TCL_OK) {
+                    return r;
+                }
+                return tcl_result(tcl, TCL_OK, tcl_dup(tcl_var(tcl, tcl->result, NULL)));
             }
-            char buf[5 + MAX_VAR_LENGTH] = "set ";
-            strncat(buf, s + 1, len - 1);
-            return tcl_eval(tcl, buf, strlen(buf) + 1);
+            if (n >= 2 && name[0] == '{') {
+                name++;
+                n -= 2;
+            }
+            return tcl_result(tcl, TCL_OK, tcl_dup(tcl_var_string(tcl, name, n, NULL)));
         }
         case '[': {
-            tcl_value_t *expr = tcl_alloc(s + 1, len - 2);
-            tcl_result_t r = tcl_eval(tcl, tcl_string(expr), tcl_length(expr) + 1);
+            /* The inner script needs its own terminator, so copy it out */
+            size_t mark = tcl->arenatop;
+            tcl_value_t *expr = tcl_word_append(tcl, NULL, s + 1, len - 2);
+            if (expr == NULL) {
+                return tcl_no_memory(tcl);
+            }
+            tcl_result_t r = tcl_eval(tcl, expr->str, expr->len + 1);
             tcl_free(expr);
+            tcl->arenatop = mark;
             return r;
         }
         default:
@@ -313,61 +1271,882 @@ tcl_result_t tcl_subst(struct tcl *tcl, const char *s, size_t len) {
     }
 }
 
-tcl_result_t tcl_eval(struct tcl *tcl, const char *s, size_t len) {
-    tcl_value_t *list = tcl_list_alloc();
-    tcl_value_t *cur = NULL;
+static int tcl_true(tcl_value_t *v) { return tcl_double(v) != 0; }
+
+tcl_result_t tcl_expr(struct tcl *tcl, tcl_value_t *v);
+
+/* Conditions of if and while are scripts like {< $i 10}, unless they start
+ * the way an expression does: $, [, (, a quote, a digit, or a unary
+ * operator stuck to its operand (- 1 and != are still commands) */
+static int tcl_is_expr(const char *s, size_t len) {
+    while (len > 0 && (tcl_is_space(*s) || *s == '\n' || *s == '\r')) {
+        s++, len--;
+    }
+    if (len == 0 || *s == '\0') {
+        return 0;
+    }
+    if (*s == '-' || *s == '+' || *s == '!' || *s == '~') {
+        return len > 1 && !tcl_is_space(s[1]) && s[1] != '=';
+    }
+    return strchr("$[(\"", *s) != NULL || (*s >= '0' && *s <= '9');
+}
+
+static void *tcl_grow(void *p, int n, size_t size);
+
+/* FNV-1a */
+static unsigned int tcl_hash(const char *s, size_t len) {
+    unsigned int h = 2166136261u;
+    while (len-- > 0) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+/* Command defined in this interpreter itself */
+static struct tcl_cmd *tcl_find(const struct tcl *tcl, const char *name, size_t len) {
+    struct tcl_cmd *cmd;
+    unsigned int h;
+    if (tcl->cmdslen == 0) {
+        return NULL;
+    }
+    h = tcl_hash(name, len);
+    for (cmd = tcl->cmds[h & (tcl->cmdslen - 1)]; cmd != NULL; cmd = cmd->next) {
+        if (cmd->hash == h && cmd->name->len == len && memcmp(cmd->name->str, name, len) == 0) {
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+static struct tcl_cmd *tcl_adopt(struct tcl *tcl, const struct tcl_cmd *cmd);
+
+struct tcl_cmd *tcl_lookup(struct tcl *tcl, const char *name, size_t len) {
+    struct tcl_cmd *cmd = tcl_find(tcl, name, len);
+    if (cmd == NULL && tcl->shared != NULL && (cmd = tcl_find(tcl->shared, name, len)) != NULL) {
+        return tcl_adopt(tcl, cmd);
+    }
+    return cmd;
+}
+
+#if TCL_TRACE
+/* Records a begin or end event. A loop iteration passes something that
+ * identifies its loop, and is numbered by how many iterations of the same
+ * loop went before it inside the same parent. */
+static void tcl_trace(struct tcl *tcl, char ph, char cat, const char *name, const void *loop) {
+    struct tcl_trace *tr = &tcl->trace;
+    if (!tr->on || (ph == 'E' && tr->depth == 0)) {
+        return; /* off, or the end of something begun before it was on */
+    }
+    struct tcl_event *e = &tr->ring[tr->n++ % TCL_TRACE];
+    e->t = tcl_ticks();
+    e->name = name;
+    e->ph = ph;
+    e->cat = cat;
+    e->iter = -1;
+    if (ph == 'E') {
+        e->depth = --tr->depth;
+        return;
+    }
+    e->depth = tr->depth++;
+    if (loop != NULL && e->depth < TCL_TRACE_DEPTH) {
+        tr->iter[e->depth] = (tr->loop[e->depth] == loop ? tr->iter[e->depth] + 1 : 0);
+        tr->loop[e->depth] = loop;
+        e->iter = tr->iter[e->depth];
+    }
+    if (tr->depth < TCL_TRACE_DEPTH) {
+        tr->loop[tr->depth] = NULL; /* loops inside this start counting afresh */
+    }
+}
+
+#endif
+
+static tcl_result_t tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg);
+
+/* Bookkeeping around a call, for tcl_call() and the calls tcl_exec() makes
+ * in place */
+static void tcl_call_enter(struct tcl *tcl, struct tcl_frame *f) {
+    (void)tcl, (void)f;
+#if TCL_TRACE
+    tcl_trace(tcl, 'B', (f->cmd->fn == tcl_user_proc ? 'p' : 'c'), f->cmd->name->str, NULL);
+    f->depth = tcl->trace.depth;
+#endif
+#if TCL_PROFILE
+    f->outer = tcl->callees;
+    f->bytes = tcl_allocated;
+    f->start = tcl_ticks();
+    tcl->callees = 0;
+#endif
+}
+
+static tcl_result_t tcl_call_leave(struct tcl *tcl, struct tcl_frame *f, tcl_result_t r) {
+    (void)tcl, (void)f;
+#if TCL_PROFILE
+    /* Commands are only freed with the interpreter, so cmd outlives the call */
+    unsigned long t = tcl_ticks() - f->start;
+    f->cmd->prof.calls++;
+    f->cmd->prof.incl += t;
+    f->cmd->prof.excl += t - tcl->callees;
+    f->cmd->prof.bytes += tcl_allocated - f->bytes;
+    tcl->callees = f->outer + t;
+#endif
+#if TCL_TRACE
+    tcl_trace(tcl, 'E', (f->cmd->fn == tcl_user_proc ? 'p' : 'c'), f->cmd->name->str, NULL);
+#endif
+#if TCL_ACCOUNT
+    /* Over the limit: the command that got there fails, and unwinding
+     * releases what the callers were holding */
+    if (tcl->heap.over) {
+        r = tcl_no_memory(tcl);
+        tcl->heap.over = 0;
+    }
+#endif
+    return r;
+}
+
+static tcl_result_t tcl_call(struct tcl *tcl, struct tcl_cmd *cmd, int argc, tcl_value_t **argv) {
+    if (cmd == NULL) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("unknown command", 15));
+    }
+    if (cmd->arity != 0 && cmd->arity != argc) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("arity mismatch", 14));
+    }
+    struct tcl_frame f;
+    f.cmd = cmd;
+    tcl_call_enter(tcl, &f);
+    return tcl_call_leave(tcl, &f, cmd->fn(tcl, argc, argv, cmd->arg));
+}
+
+/* Counts one more evaluation running on the C stack, failing if there are
+ * too many. The caller undoes the count either way. */
+static tcl_result_t tcl_nest(struct tcl *tcl) {
+    if (++tcl->nest > TCL_MAX_NEST || tcl->nest + tcl->ncalls > TCL_MAX_DEPTH) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("too many nested calls", 21));
+    }
+    return TCL_OK;
+}
+
+/* Looks up the command named by argv[0] and calls it */
+static tcl_result_t tcl_invoke(struct tcl *tcl, int argc, tcl_value_t **argv) {
+    return tcl_call(tcl, tcl_lookup(tcl, tcl_string(argv[0]), tcl_length(argv[0])), argc, argv);
+}
+
+tcl_result_t tcl_eval(struct tcl *tcl, const char *s, size_t len) {
+    tcl_value_t *local[8];
+    tcl_value_t **argv = local;
+    tcl_value_t *cur = NULL;
+    int argc = 0;
+    int argcap = 8;
+    size_t mark = tcl->arenatop;
+    tcl_result_t r = TCL_OK;
+#if TCL_ACCOUNT
+    /* What gets allocated from here on is charged to this interpreter */
+    struct tcl_heap *heap = tcl_heap;
+    if (heap != &tcl->heap) {
+        tcl->heap.over = 0;
+        tcl_heap = &tcl->heap;
+    }
+#endif
+    if (tcl_nest(tcl) != TCL_OK) {
+        tcl->nest--;
+#if TCL_ACCOUNT
+        tcl_heap = heap;
+#endif
+        return TCL_ERROR;
+    }
     tcl_each(s, len, 1) {
+        const char *from = p.from;
+        size_t n = p.to - p.from;
         switch (p.token) {
             case TOK_ERROR:
-                tcl_list_free(list); tcl_free(cur);
-                return tcl_result(tcl, TCL_ERROR, tcl_alloc("syntax error", 12));
+                r = tcl_result(tcl, TCL_ERROR, tcl_alloc("syntax error", 12));
+                break;
             case TOK_WORD:
-                if (cur != NULL) {
-                    tcl_subst(tcl, p.from, p.to - p.from);
-                    tcl_value_t *part = tcl_dup(tcl->result);
-                    cur = tcl_append(cur, part);
+            case TOK_PART:
+                if (n > 0 && (from[0] == '$' || from[0] == '[')) {
+                    r = tcl_subst(tcl, from, n);
+                    if (r != TCL_OK) {
+                        break;
+                    }
+                    if (cur == NULL && p.token == TOK_WORD) {
+                        /* A whole word is the value itself, no copy needed */
+                        cur = tcl_dup(tcl->result);
+                    } else {
+                        cur = tcl_word_append(tcl, cur, tcl_string(tcl->result), tcl_length(tcl->result));
+                    }
+                } else if (n > 0 && from[0] == '{') {
+                    if (n <= 1) {
+                        r = tcl_result(tcl, TCL_ERROR, tcl_alloc("syntax error", 12));
+                        break;
+                    }
+                    cur = tcl_word_append(tcl, cur, from + 1, n - 2);
                 } else {
-                    tcl_subst(tcl, p.from, p.to - p.from);
-                    cur = tcl_dup(tcl->result);
+                    cur = tcl_word_append(tcl, cur, from, n);
+                }
+                if (cur == NULL) {
+                    r = tcl_no_memory(tcl);
+                    break;
+                }
+                if (p.token == TOK_WORD) {
+                    if (argc == argcap) {
+                        tcl_value_t **more = (tcl_value_t **)tcl_malloc(2 * argcap * sizeof(*argv));
+                        memcpy(more, argv, argc * sizeof(*argv));
+                        if (argv != local) {
+                            tcl_mfree(argv);
+                        }
+                        argv = more;
+                        argcap *= 2;
+                    }
+                    argv[argc++] = cur;
+                    cur = NULL;
                 }
-                list = tcl_list_append(list, cur);
-                tcl_free(cur);
-                cur = NULL;
-                break;
-            case TOK_PART:
-                tcl_subst(tcl, p.from, p.to - p.from);
-                tcl_value_t *part = tcl_dup(tcl->result);
-                cur = tcl_append(cur, part);
                 break;
             case TOK_COMMAND:
-                if (tcl_list_length(list) == 0) {
+                if (argc == 0) {
                     tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
                 } else {
-                    tcl_value_t *cmdname = tcl_list_at(list, 0);
-                    struct tcl_cmd *cmd = NULL;
-                    tcl_result_t r = TCL_ERROR;
-                    for (cmd = tcl->cmds; cmd != NULL; cmd = cmd->next) {
-                        if (strcmp(tcl_string(cmdname), tcl_string(cmd->name)) == 0) {
-                            if (cmd->arity != 0 && cmd->arity != tcl_list_length(list)) r = cmd->fn(tcl, list, cmd->arg);
-                            else {
-                                r = tcl_result(tcl, TCL_ERROR, tcl_alloc("arity mismatch", 14))
-                            }
-                            break;
+                    r = tcl_invoke(tcl, argc, argv);
+                }
+                while (argc > 0) {
+                    tcl_free(argv[--argc]);
+                }
+                tcl->arenatop = mark;
+                break;
+        }
+        if (r != TCL_OK) {
+            break;
+        }
+    }
+    while (argc > 0) {
+        tcl_free(argv[--argc]);
+    }
+    tcl_free(cur);
+    if (argv != local) {
+        tcl_mfree(argv);
+    }
+    tcl->arenatop = mark;
+    tcl->nest--;
+#if TCL_ACCOUNT
+    tcl_heap = heap;
+#endif
+    return r;
+}
+
+/* Reads up to n bytes into buf, returns how many, 0 at the end */
+typedef size_t (*tcl_read_fn_t)(void *ctx, char *buf, size_t n);
+
+/* Evaluates a script as it is read, TCL_CHUNK bytes at a time. Only the
+ * command being read is held in memory, not the whole script, so the buffer
+ * grows only for a command (usually a braced body) longer than that. */
+tcl_result_t tcl_eval_stream(struct tcl *tcl, tcl_read_fn_t fn, void *ctx) {
+    struct tcl_reader reader;
+    tcl_result_t r = tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+    size_t n;
+    tcl_reader_init(&reader);
+    do {
+        n = fn(ctx, tcl_reader_reserve(&reader, TCL_CHUNK), TCL_CHUNK);
+        if (tcl_reader_commit(&reader, n)) {
+            r = tcl_reader_eval(tcl, &reader);
+        }
+    } while (r == TCL_OK && n > 0);
+    if (r == TCL_OK && reader.len > 0) {
+        /* A last line without a newline, or an unfinished command */
+        tcl_reader_feed(&reader, "\n", 1);
+        r = tcl_eval(tcl, reader.buf, reader.len);
+    }
+    tcl_reader_free(&reader);
+    return r;
+}
+
+/* --------------------------------- */
+/* --------------------------------- */
+/* Bytecode compiler and VM.
+ * A script compiles to a flat array of instructions, each an 8-bit opcode
+ * with a 24-bit operand, plus a table of literals. Words are pushed onto
+ * tcl->stack and OP_INVOKE hands the top n of them to a command. while and
+ * if with braced arguments are inlined as jumps, so a loop never re-lexes
+ * its condition or body. Anything the compiler does not understand makes
+ * tcl_compile() return NULL and the caller falls back to tcl_eval(). */
+enum tcl_op {
+    OP_PUSH,       /* push literal */
+    OP_LOAD,       /* push the variable named by a literal */
+    OP_LOADS,      /* replace top of stack by the variable it names */
+    OP_LOCAL,      /* push proc local in slot n */
+    OP_STORE,      /* pop into proc local in slot n, which is the result */
+    OP_RESULT,     /* push the interpreter result */
+    OP_CONCAT,     /* join top n values into one word */
+    OP_INVOKE,     /* call command of call site n with its words */
+    OP_EMPTY,      /* empty command, result becomes "" */
+    OP_JUMP,       /* jump to operand */
+    OP_JUMP_FALSE, /* jump to operand if the result is false */
+    OP_EXPR,       /* evaluate literal as an expression into the result */
+    OP_TRACE,      /* loop iteration begins (1) or ends (0), with TCL_TRACE */
+};
+
+/* Inlined while loop, so break and continue know where to go */
+struct tcl_loop {
+    int from;  /* first body instruction */
+    int to;    /* one past the last body instruction */
+    int brk;   /* target for TCL_BREAK */
+    int cont;  /* target for TCL_AGAIN */
+    int depth; /* stack depth at loop entry */
+};
+
+/* A command invocation, remembering which command its name resolved to.
+ * The cache is good for as long as tcl->epoch does not change. */
+struct tcl_site {
+    int argc;
+    int name; /* literal holding the command name, -1 if computed */
+    struct tcl_cmd *cmd;
+    unsigned int epoch;
+};
+
+struct tcl_code {
+    struct tcl_proc *proc; /* gives locals slots while compiling a proc body */
+    unsigned int *ops;
+    int nops;
+    tcl_value_t **lits;
+    int nlits;
+    struct tcl_site *sites;
+    int nsites;
+    struct tcl_loop *loops;
+    int nloops;
+    int depth; /* stack depth reached so far while compiling */
+    int maxdepth;
+};
+
+/* Token of the command being compiled */
+struct tcl_span {
+    const char *from;
+    const char *to;
+    tcl_token token;
+};
+
+static tcl_result_t tcl_cmd_while(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg);
+static tcl_result_t tcl_cmd_if(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg);
+static tcl_result_t tcl_cmd_set(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg);
+static tcl_result_t tcl_cmd_expr(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg);
+static int tcl_compile_script(struct tcl *tcl, struct tcl_code *c, const char *s, size_t len);
+
+/* Grows an array about to receive element n (doubling, 8 at first) */
+static void *tcl_grow(void *p, int n, size_t size) {
+    if (n == 0 || (n >= 8 && (n & (n - 1)) == 0)) {
+        p = tcl_realloc(p, (n == 0 ? 8 : 2 * n) * size);
+    }
+    return p;
+}
+
+static int tcl_emit(struct tcl_code *c, int op, int arg) {
+    static const signed char effect[] = {1, 1, 0, 1, -1, 1, 0, 0, 0, 0, 0, 0, 0};
+    c->ops = (unsigned int *)tcl_grow(c->ops, c->nops, sizeof(*c->ops));
+    c->ops[c->nops] = (unsigned int)arg << 8 | op;
+    if (op == OP_CONCAT) {
+        c->depth -= arg - 1;
+    } else if (op == OP_INVOKE) {
+        c->depth -= c->sites[arg].argc;
+    } else {
+        c->depth += effect[op];
+    }
+    if (c->depth > c->maxdepth) {
+        c->maxdepth = c->depth;
+    }
+    return c->nops++;
+}
+
+static void tcl_patch(struct tcl_code *c, int at, int target) {
+    c->ops[at] = (unsigned int)target << 8 | (c->ops[at] & 0xff);
+}
+
+static int tcl_emit_lit(struct tcl_code *c, int op, const char *s, size_t len) {
+    c->lits = (tcl_value_t **)tcl_grow(c->lits, c->nlits, sizeof(*c->lits));
+    c->lits[c->nlits] = tcl_alloc(s, len);
+    return tcl_emit(c, op, c->nlits++);
+}
+
+/* Slot of a proc local, allocating one the first time a name is seen */
+static int tcl_local(struct tcl_proc *proc, const char *name, size_t len) {
+    int i = tcl_local_find(proc, name, len);
+    if (i < 0) {
+        proc->locals = (tcl_value_t **)tcl_grow(proc->locals, proc->nlocals, sizeof(*proc->locals));
+        proc->locals[proc->nlocals] = tcl_alloc(name, len);
+        i = proc->nlocals++;
+    }
+    return i;
+}
+
+/* Emits code pushing the value of one token, mirroring tcl_subst() */
+static int tcl_compile_word(struct tcl *tcl, struct tcl_code *c, const char *s, size_t len) {
+    if (len == 0) {
+        tcl_emit_lit(c, OP_PUSH, "", 0);
+        return 1;
+    }
+    switch (s[0]) {
+        case '{':
+            if (len <= 1) {
+                return 0;
+            }
+            tcl_emit_lit(c, OP_PUSH, s + 1, len - 2);
+            return 1;
+        case '$': {
+            if (!tcl_compile_word(tcl, c, s + 1, len - 1)) {
+                return 0;
+            }
+            /* A literal name is looked up directly, in a proc by slot */
+            unsigned int *last = &c->ops[c->nops - 1];
+            if ((*last & 0xff) == OP_PUSH && c->proc != NULL) {
+                tcl_value_t *name = c->lits[*last >> 8];
+                *last = (unsigned int)tcl_local(c->proc, name->str, name->len) << 8 | OP_LOCAL;
+            } else if ((*last & 0xff) == OP_PUSH) {
+                *last = (*last & ~0xffu) | OP_LOAD;
+            } else {
+                tcl_emit(c, OP_LOADS, 0);
+            }
+            return 1;
+        }
+        case '[': {
+            tcl_value_t *inner = tcl_alloc(s + 1, len - 2);
+            int ok = tcl_compile_script(tcl, c, tcl_string(inner), tcl_length(inner) + 1);
+            tcl_free(inner);
+            if (ok) {
+                tcl_emit(c, OP_RESULT, 0);
+            }
+            return ok;
+        }
+        default:
+            tcl_emit_lit(c, OP_PUSH, s, len);
+            return 1;
+    }
+}
+
+/* Compiles the contents of a braced word */
+static int tcl_compile_body(struct tcl *tcl, struct tcl_code *c, struct tcl_span *w) {
+    tcl_value_t *inner = tcl_alloc(w->from + 1, w->to - w->from - 2);
+    int ok = tcl_compile_script(tcl, c, tcl_string(inner), tcl_length(inner) + 1);
+    tcl_free(inner);
+    return ok;
+}
+
+/* Compiles a braced if or while condition, an expression or a script */
+static int tcl_compile_cond(struct tcl *tcl, struct tcl_code *c, struct tcl_span *w) {
+    if (tcl_is_expr(w->from + 1, w->to - w->from - 2)) {
+        tcl_emit_lit(c, OP_EXPR, w->from + 1, w->to - w->from - 2);
+        return 1;
+    }
+    return tcl_compile_body(tcl, c, w);
+}
+
+static int tcl_span_is(struct tcl_span *w, const char *s) {
+    size_t n = strlen(s);
+    return (size_t)(w->to - w->from) == n && strncmp(w->from, s, n) == 0;
+}
+
+/* Only inline control commands that have not been redefined */
+static int tcl_is_builtin(struct tcl *tcl, struct tcl_span *w, tcl_cmd_fn_t fn) {
+    struct tcl_cmd *cmd = tcl_lookup(tcl, w->from, w->to - w->from);
+    return cmd != NULL && cmd->fn == fn;
+}
+
+/* while {cond} {body} */
+static int tcl_compile_while(struct tcl *tcl, struct tcl_code *c, struct tcl_span *w) {
+    struct tcl_loop loop;
+    int top = c->nops;
+    loop.depth = c->depth;
+    if (!tcl_compile_cond(tcl, c, &w[1])) {
+        return 0;
+    }
+    int jf = tcl_emit(c, OP_JUMP_FALSE, 0);
+#if TCL_TRACE
+    tcl_emit(c, OP_TRACE, 1);
+#endif
+    loop.from = c->nops;
+    if (!tcl_compile_body(tcl, c, &w[2])) {
+        return 0;
+    }
+#if TCL_TRACE
+    tcl_emit(c, OP_TRACE, 0);
+#endif
+    tcl_emit(c, OP_JUMP, top);
+    tcl_patch(c, jf, c->nops);
+    loop.to = loop.brk = c->nops;
+    loop.cont = top;
+    /* Inner loops finish first, so the first match is the innermost */
+    c->loops = (struct tcl_loop *)tcl_grow(c->loops, c->nloops, sizeof(*c->loops));
+    c->loops[c->nloops++] = loop;
+    return 1;
+}
+
+/* if {cond} {branch} ?{cond} {branch}? ?{other}? */
+static int tcl_compile_if(struct tcl *tcl, struct tcl_code *c, struct tcl_span *w, int n) {
+    int *ends = (int *)tcl_malloc(n * sizeof(int));
+    int i, k = 0, ok = 1;
+    for (i = 1; ok && i < n; i += 2) {
+        if (i + 1 == n) {
+            ok = tcl_compile_body(tcl, c, &w[i]);
+            break;
+        }
+        ok = tcl_compile_cond(tcl, c, &w[i]);
+        if (ok) {
+            int jf = tcl_emit(c, OP_JUMP_FALSE, 0);
+            ok = tcl_compile_body(tcl, c, &w[i + 1]);
+            ends[k++] = tcl_emit(c, OP_JUMP, 0);
+            tcl_patch(c, jf, c->nops);
+        }
+    }
+    while (k > 0) {
+        tcl_patch(c, ends[--k], c->nops);
+    }
+    tcl_mfree(ends);
+    return ok;
+}
+
+static int tcl_compile_command(struct tcl *tcl, struct tcl_code *c, struct tcl_span *w, int n, int words) {
+    int i, j, k;
+    int name = -1;
+    if (n == 0) {
+        tcl_emit(c, OP_EMPTY, 0);
+        return 1;
+    }
+    if (w[n - 1].token != TOK_WORD) {
+        return 0;
+    }
+    if (n == words && n >= 3) {
+        int braced = 1;
+        for (i = 1; i < n; i++) {
+            braced = braced && w[i].from[0] == '{';
+        }
+        if (braced && n == 3 && tcl_span_is(&w[0], "while") && tcl_is_builtin(tcl, &w[0], tcl_cmd_while)) {
+            return tcl_compile_while(tcl, c, w);
+        }
+        if (braced && tcl_span_is(&w[0], "if") && tcl_is_builtin(tcl, &w[0], tcl_cmd_if)) {
+            return tcl_compile_if(tcl, c, w, n);
+        }
+    }
+    /* expr {...} evaluates the tree cached on its literal, no call needed */
+    if (n == words && n == 2 && w[1].from[0] == '{' && tcl_span_is(&w[0], "expr") && tcl_is_builtin(tcl, &w[0], tcl_cmd_expr)) {
+        tcl_emit_lit(c, OP_EXPR, w[1].from + 1, w[1].to - w[1].from - 2);
+        return 1;
+    }
+    /* set with a literal name in a proc body reads and writes the slot */
+    if (c->proc != NULL && n == words && (n == 2 || n == 3) && w[1].from[0] != '$' && w[1].from[0] != '[' &&
+        tcl_span_is(&w[0], "set") && tcl_is_builtin(tcl, &w[0], tcl_cmd_set)) {
+        int braced = (w[1].from[0] == '{');
+        int slot = tcl_local(c->proc, w[1].from + braced, w[1].to - w[1].from - 2 * braced);
+        if (n == 2) {
+            tcl_emit(c, OP_LOCAL, slot);
+        } else if (!tcl_compile_word(tcl, c, w[2].from, w[2].to - w[2].from)) {
+            return 0;
+        }
+        tcl_emit(c, OP_STORE, slot);
+        return 1;
+    }
+    for (i = 0; i < n; i += k) {
+        for (k = 1; w[i + k - 1].token != TOK_WORD; k++) {
+        }
+        for (j = i; j < i + k; j++) {
+            if (!tcl_compile_word(tcl, c, w[j].from, w[j].to - w[j].from)) {
+                return 0;
+            }
+        }
+        if (k > 1) {
+            tcl_emit(c, OP_CONCAT, k);
+        } else if (i == 0 && (c->ops[c->nops - 1] & 0xff) == OP_PUSH) {
+            name = c->ops[c->nops - 1] >> 8;
+        }
+    }
+    c->sites = (struct tcl_site *)tcl_grow(c->sites, c->nsites, sizeof(*c->sites));
+    c->sites[c->nsites].argc = words;
+    c->sites[c->nsites].name = name;
+    c->sites[c->nsites].cmd = NULL;
+    c->sites[c->nsites].epoch = 0;
+    tcl_emit(c, OP_INVOKE, c->nsites++);
+    return 1;
+}
+
+static int tcl_compile_script(struct tcl *tcl, struct tcl_code *c, const char *s, size_t len) {
+    struct tcl_span *spans = NULL;
+    int n = 0, words = 0, ok = 1;
+    tcl_each(s, len, 1) {
+        if (p.token == TOK_ERROR) {
+            ok = 0;
+            break;
+        } else if (p.token == TOK_COMMAND) {
+            ok = tcl_compile_command(tcl, c, spans, n, words);
+            if (!ok) {
+                break;
+            }
+            n = words = 0;
+        } else {
+            spans = (struct tcl_span *)tcl_grow(spans, n, sizeof(*spans));
+            spans[n].from = p.from;
+            spans[n].to = p.to;
+            spans[n].token = p.token;
+            n++;
+            words += (p.token == TOK_WORD);
+        }
+    }
+    tcl_mfree(spans);
+    return ok;
+}
+
+void tcl_code_free(struct tcl_code *c) {
+    if (c == NULL) {
+        return;
+    }
+    for (int i = 0; i < c->nlits; i++) {
+        tcl_free(c->lits[i]);
+    }
+    tcl_mfree(c->ops);
+    tcl_mfree(c->lits);
+    tcl_mfree(c->sites);
+    tcl_mfree(c->loops);
+    tcl_mfree(c);
+}
+
+/* Compiles a script, returns NULL if compilation is off or fails. Given a
+ * proc, variables are resolved to its frame slots. */
+struct tcl_code *tcl_compile(struct tcl *tcl, const char *s, size_t len, struct tcl_proc *proc = NULL) {
+    if (!tcl->compile) {
+        return NULL;
+    }
+    struct tcl_code *c = (struct tcl_code *)tcl_calloc(1, sizeof(*c));
+    c->proc = proc;
+    if (!tcl_compile_script(tcl, c, s, len)) {
+        tcl_code_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static void tcl_proc_free(void *arg);
+
+/* Opens a frame for proc, its parameters bound to argv[1] onwards */
+static void tcl_proc_enter(struct tcl *tcl, struct tcl_proc *proc, int argc, tcl_value_t **argv) {
+    proc->refs++;
+    tcl_env_push(tcl, proc);
+    for (int i = 0; i < proc->nparams && i + 1 < argc; i++) {
+        tcl->env->slots[i] = tcl_dup(argv[i + 1]);
+    }
+}
+
+static void tcl_proc_leave(struct tcl *tcl, struct tcl_proc *proc) {
+    tcl_env_pop(tcl);
+    tcl_proc_free(proc);
+}
+
+static void tcl_stack_reserve(struct tcl *tcl, int n) {
+    if (tcl->sp + n > tcl->stacklen) {
+        tcl->stacklen = tcl->sp + n + 16;
+        tcl->stack = (tcl_value_t **)tcl_realloc(tcl->stack, tcl->stacklen * sizeof(*tcl->stack));
+    }
+}
+
+/* Calls to compiled procs do not recurse: the caller's place is pushed on
+ * tcl->calls and the loop carries on in the callee's code, popping it back
+ * when that ends. Only commands implemented in C nest on the C stack. */
+tcl_result_t tcl_exec(struct tcl *tcl, struct tcl_code *c) {
+    int base = tcl->sp;
+    int pc = 0;
+    int i;
+    int calls = tcl->ncalls;
+    size_t mark = tcl->arenatop;
+    tcl_result_t r = tcl_nest(tcl);
+#if TCL_TRACE
+    int depth = tcl->trace.depth;
+#endif
+    tcl_stack_reserve(tcl, c->maxdepth);
+    /* tcl->stack may move under nested runs, so index it afresh each time */
+    for (;;) {
+        if (r != TCL_OK || pc >= c->nops) {
+            if (tcl->ncalls == calls) {
+                break;
+            }
+            /* The end of a proc called in place: back to the caller */
+            struct tcl_frame *f = &tcl->calls[--tcl->ncalls];
+#if TCL_TRACE
+            while (tcl->trace.on && tcl->trace.depth > f->depth) {
+                tcl_trace(tcl, 'E', 'l', "while", NULL);
+            }
+#endif
+            while (tcl->sp > base) {
+                tcl_free(tcl->stack[--tcl->sp]);
+            }
+            tcl->arenatop = mark;
+            tcl_proc_leave(tcl, f->proc);
+            r = tcl_call_leave(tcl, f, r == TCL_ERROR ? TCL_ERROR : TCL_OK);
+            c = f->code;
+            pc = f->pc;
+            base = f->base;
+            mark = f->mark;
+            if (tcl->sp == base) {
+                tcl->arenatop = mark;
+            }
+            continue;
+        }
+        int op = c->ops[pc] & 0xff;
+        int arg = c->ops[pc++] >> 8;
+        switch (op) {
+            case OP_PUSH:
+                tcl->stack[tcl->sp++] = tcl_dup(c->lits[arg]);
+                break;
+            case OP_LOAD:
+                tcl->stack[tcl->sp++] = tcl_dup(tcl_var(tcl, c->lits[arg], NULL));
+                break;
+            case OP_LOADS: {
+                tcl_value_t *name = tcl->stack[tcl->sp - 1];
+                tcl->stack[tcl->sp - 1] = tcl_dup(tcl_var(tcl, name, NULL));
+                tcl_free(name);
+                break;
+            }
+            case OP_LOCAL:
+                tcl->stack[tcl->sp++] = tcl_dup(tcl_env_slot(tcl->env, arg, NULL));
+                break;
+            case OP_STORE: {
+                tcl_value_t *v = tcl_keep(tcl->stack[--tcl->sp]);
+                tcl_result(tcl, TCL_OK, tcl_dup(tcl_env_slot(tcl->env, arg, v)));
+                break;
+            }
+            case OP_RESULT:
+                tcl->stack[tcl->sp++] = tcl_dup(tcl->result);
+                break;
+            case OP_CONCAT: {
+                tcl_value_t *word;
+                size_t n = 0;
+                for (i = tcl->sp - arg; i < tcl->sp; i++) {
+                    n += tcl_length(tcl->stack[i]);
+                }
+                /* One allocation for the whole word, in the arena if it fits */
+                word = tcl_word_new(tcl, n);
+                if (word == NULL && (word = tcl_reserve(NULL, n)) == NULL) {
+                    r = tcl_no_memory(tcl);
+                    break;
+                }
+                n = 0;
+                for (i = tcl->sp - arg; i < tcl->sp; i++) {
+                    memcpy(word->str + word->len + n, tcl->stack[i]->str, tcl->stack[i]->len);
+                    n += tcl->stack[i]->len;
+                    tcl_free(tcl->stack[i]);
+                }
+                tcl_finalize(word, n);
+                tcl->sp -= arg - 1;
+                tcl->stack[tcl->sp - 1] = word;
+                break;
+            }
+            case OP_INVOKE: {
+                struct tcl_site *site = &c->sites[arg];
+                int argc = site->argc;
+                /* Moved off the stack, which nested runs may reallocate */
+                tcl_value_t *local[8];
+                tcl_value_t **argv = (argc <= 8 ? local : (tcl_value_t **)tcl_malloc(argc * sizeof(*argv)));
+                struct tcl_cmd *cmd;
+                tcl->sp -= argc;
+                memcpy(argv, &tcl->stack[tcl->sp], argc * sizeof(*argv));
+                if (site->name < 0) {
+                    cmd = tcl_lookup(tcl, tcl_string(argv[0]), tcl_length(argv[0]));
+                } else {
+                    if (site->epoch != tcl->epoch) {
+                        tcl_value_t *name = c->lits[site->name];
+                        site->cmd = tcl_lookup(tcl, tcl_string(name), tcl_length(name));
+                        site->epoch = tcl->epoch;
+                    }
+                    cmd = site->cmd;
+                }
+                if (cmd != NULL && cmd->fn == tcl_user_proc && ((struct tcl_proc *)cmd->arg)->code != NULL) {
+                    struct tcl_proc *proc = (struct tcl_proc *)cmd->arg;
+                    if (tcl->nest + tcl->ncalls >= TCL_MAX_DEPTH) {
+                        r = tcl_result(tcl, TCL_ERROR, tcl_alloc("too many nested calls", 21));
+                    } else {
+                        if (tcl->ncalls == tcl->callslen) {
+                            tcl->callslen = (tcl->callslen == 0 ? 8 : 2 * tcl->callslen);
+                            tcl->calls = (struct tcl_frame *)tcl_realloc(tcl->calls, tcl->callslen * sizeof(*tcl->calls));
                         }
+                        struct tcl_frame *f = &tcl->calls[tcl->ncalls++];
+                        f->cmd = cmd;
+                        f->proc = proc;
+                        f->code = c;
+                        f->pc = pc;
+                        f->base = base;
+                        f->mark = mark;
+                        tcl_call_enter(tcl, f);
+                        tcl_proc_enter(tcl, proc, argc, argv);
+                        c = proc->code;
+                        pc = 0;
+                        base = tcl->sp;
+                        mark = tcl->arenatop;
+                        tcl_stack_reserve(tcl, c->maxdepth);
                     }
-                    tcl_free(cmdname);
-                    if (cmd == NULL || r != TCL_OK) {
-                        tcl_list_free(list);
-                        return r;
+                } else {
+                    r = tcl_call(tcl, cmd, argc, argv);
+                }
+                for (i = 0; i < argc; i++) {
+                    tcl_free(argv[i]);
+                }
+                if (argv != local) {
+                    tcl_mfree(argv);
+                }
+                if (tcl->sp == base) {
+                    /* No words of an enclosing command are left in the arena */
+                    tcl->arenatop = mark;
+                }
+                if (r != TCL_BREAK && r != TCL_AGAIN) {
+                    break;
+                }
+                for (i = 0; i < c->nloops; i++) {
+                    struct tcl_loop *loop = &c->loops[i];
+                    if (loop->from < pc && pc <= loop->to) {
+                        while (tcl->sp > base + loop->depth) {
+                            tcl_free(tcl->stack[--tcl->sp]);
+                        }
+                        pc = (r == TCL_BREAK ? loop->brk : loop->cont);
+                        r = TCL_OK;
+#if TCL_TRACE
+                        tcl_trace(tcl, 'E', 'l', "while", NULL);
+#endif
+                        break;
                     }
                 }
-                tcl_list_free(list);
-                list = tcl_list_alloc();
                 break;
+            }
+            case OP_EMPTY:
+                tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
+                break;
+            case OP_JUMP:
+                pc = arg;
+                break;
+            case OP_JUMP_FALSE:
+                if (!tcl_true(tcl->result)) {
+                    pc = arg;
+                }
+                break;
+            case OP_EXPR:
+                r = tcl_expr(tcl, c->lits[arg]);
+                break;
+#if TCL_TRACE
+            case OP_TRACE:
+                /* The instruction itself tells the loops apart */
+                tcl_trace(tcl, (arg ? 'B' : 'E'), 'l', "while", &c->ops[pc - 1]);
+                break;
+#endif
         }
     }
-    tcl_list_free(list);
-    return TCL_OK;
+#if TCL_TRACE
+    /* Iterations left by an error or return end here */
+    while (tcl->trace.on && tcl->trace.depth > depth) {
+        tcl_trace(tcl, 'E', 'l', "while", NULL);
+    }
+#endif
+    while (tcl->sp > base) {
+        tcl_free(tcl->stack[--tcl->sp]);
+    }
+    tcl->arenatop = mark;
+    tcl->nest--;
+    return r;
+}
+
+/* Runs compiled code if there is any, the source text otherwise */
+static tcl_result_t tcl_run(struct tcl *tcl, struct tcl_code *code, tcl_value_t *src) {
+    if (code != NULL) {
+        return tcl_exec(tcl, code);
+    }
+    return tcl_eval(tcl, tcl_string(src), tcl_length(src) + 1);
 }
 
 /* --------------------------------- */
@@ -375,165 +2154,336 @@ tcl_result_t tcl_eval(struct tcl *tcl, const char *s, size_t len) {
 /* --------------------------------- */
 /* --------------------------------- */
 /* --------------------------------- */
-void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity, void *arg = NULL) {
-    struct tcl_cmd *cmd = malloc(sizeof(struct tcl_cmd));
-    cmd->name = tcl_alloc(name, strlen(name));
+static void tcl_cmd_release(struct tcl_cmd *cmd) {
+    if (cmd->cleanup != NULL) {
+        cmd->cleanup(cmd->arg);
+    } else {
+        tcl_mfree(cmd->arg);
+    }
+}
+
+static void tcl_rehash(struct tcl *tcl) {
+    int len = (tcl->cmdslen == 0 ? 64 : 2 * tcl->cmdslen);
+    struct tcl_cmd **cmds = (struct tcl_cmd **)tcl_calloc(len, sizeof(*cmds));
+    for (int i = 0; i < tcl->cmdslen; i++) {
+        while (tcl->cmds[i] != NULL) {
+            struct tcl_cmd *cmd = tcl->cmds[i];
+            tcl->cmds[i] = cmd->next;
+            cmd->next = cmds[cmd->hash & (len - 1)];
+            cmds[cmd->hash & (len - 1)] = cmd;
+        }
+    }
+    tcl_mfree(tcl->cmds);
+    tcl->cmds = cmds;
+    tcl->cmdslen = len;
+}
+
+/* Defines a command, replacing any existing one of the same name. Cached
+ * lookups are invalidated by bumping the epoch. */
+void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity, void *arg = NULL, tcl_cmd_free_fn_t cleanup = NULL) {
+    size_t len = strlen(name);
+    struct tcl_cmd *cmd = tcl_find(tcl, name, len);
+    if (cmd != NULL) {
+        tcl_cmd_release(cmd);
+    } else {
+        if (tcl->ncmds >= tcl->cmdslen) {
+            tcl_rehash(tcl);
+        }
+        cmd = (struct tcl_cmd *)tcl_malloc(sizeof(struct tcl_cmd));
+        cmd->name = tcl_alloc(name, len);
+        cmd->hash = tcl_hash(name, len);
+        cmd->next = tcl->cmds[cmd->hash & (tcl->cmdslen - 1)];
+        tcl->cmds[cmd->hash & (tcl->cmdslen - 1)] = cmd;
+        tcl->ncmds++;
+#if TCL_PROFILE
+        memset(&cmd->prof, 0, sizeof(cmd->prof));
+#endif
+    }
     cmd->fn = fn;
     cmd->arg = arg;
+    cmd->cleanup = cleanup;
     cmd->arity = arity;
-    cmd->next = tcl->cmds;
-    tcl->cmds = cmd;
+    tcl->epoch++;
 }
 
-static tcl_result_t tcl_cmd_set(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static tcl_result_t tcl_cmd_set(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
-    tcl_value_t *var = tcl_list_at(args, 1);
-    tcl_value_t *val = tcl_list_at(args, 2);
-    tcl_result_t r = tcl_result(tcl, TCL_OK, tcl_dup(tcl_var(tcl, var, val)));
-    tcl_free(var);
-    return r;
+    tcl_value_t *val = (argc > 2 ? tcl_dup(argv[2]) : NULL);
+    return tcl_result(tcl, TCL_OK, tcl_dup(tcl_var(tcl, argv[1], val)));
 }
 
-static tcl_result_t tcl_cmd_subst(struct tcl *tcl, tcl_value_t *args, void *arg) {
+/* Grows the variable in place, so a loop of appends is linear, not quadratic */
+static tcl_result_t tcl_cmd_append(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
-    tcl_value_t *s = tcl_list_at(args, 1);
-    tcl_result_t r = tcl_subst(tcl, tcl_string(s), tcl_length(s));
-    tcl_free(s);
-    return r;
+    tcl_value_t **ref;
+    int i;
+    if (argc < 2) {
+        return tcl_result(tcl, TCL_ERROR, tcl_alloc("arity mismatch", 14));
+    }
+    ref = tcl_var_ref(tcl, tcl_string(argv[1]), tcl_length(argv[1]), argc > 2);
+    if (tcl->result == *ref) {
+        /* The last append's result would otherwise force a copy */
+        tcl_free(tcl->result);
+        tcl->result = NULL;
+    }
+    for (i = 2; i < argc; i++) {
+        tcl_value_t *v = tcl_append_string(*ref, tcl_string(argv[i]), tcl_length(argv[i]));
+        if (v == NULL) {
+            *ref = tcl_alloc("", 0);
+            return tcl_no_memory(tcl);
+        }
+        *ref = v;
+    }
+    return tcl_result(tcl, TCL_OK, tcl_dup(*ref));
+}
+
+static tcl_result_t tcl_cmd_subst(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    return tcl_subst(tcl, tcl_string(argv[1]), tcl_length(argv[1]));
 }
 
-static tcl_result_t tcl_user_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    tcl_value_t *code = (tcl_value_t *)arg;
-    tcl_value_t *params = tcl_list_at(code, 2);
-    tcl_value_t *body = tcl_list_at(code, 3);
-    tcl->env = tcl_env_alloc(tcl->env);
-    for (int i = 0; i < tcl_list_length(params); i++) {
-        tcl_value_t *param = tcl_list_at(params, i);
-        tcl_value_t *v = tcl_list_at(args, i + 1);
-        tcl_var(tcl, param, v);
+static void tcl_proc_free(void *arg) {
+    struct tcl_proc *proc = (struct tcl_proc *)arg;
+    if (--proc->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < proc->nlocals; i++) {
+        tcl_free(proc->locals[i]);
+    }
+    tcl_mfree(proc->locals);
+    tcl_free(proc->params);
+    tcl_free(proc->body);
+    tcl_code_free(proc->code);
+    tcl_mfree(proc);
+}
+
+static tcl_result_t tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    struct tcl_proc *proc = (struct tcl_proc *)arg;
+    tcl_proc_enter(tcl, proc, argc, argv);
+    tcl_result_t r = tcl_run(tcl, proc->code, proc->body);
+    tcl_proc_leave(tcl, proc);
+    return r == TCL_ERROR ? TCL_ERROR : TCL_OK;
+}
+
+/* Defines proc name, taking over params and body */
+static void tcl_define(struct tcl *tcl, const char *name, tcl_value_t *params, tcl_value_t *body) {
+    struct tcl_proc *proc = (struct tcl_proc *)tcl_calloc(1, sizeof(*proc));
+    proc->refs = 1;
+    proc->params = params;
+    proc->body = body;
+    /* Have the text ready, so interpreters sharing this one only read it */
+    tcl_string(proc->params);
+    for (int i = 0; i < tcl_list_length(proc->params); i++) {
+        tcl_value_t *param = tcl_list_at(proc->params, i);
+        tcl_local(proc, tcl_string(param), tcl_length(param));
         tcl_free(param);
     }
-    tcl_eval(tcl, tcl_string(body), tcl_length(body) + 1);
-    tcl->env = tcl_env_free(tcl->env);
-    tcl_free(params);
-    tcl_free(body);
-    return TCL_OK;
+    proc->nparams = proc->nlocals;
+    proc->code = tcl_compile(tcl, tcl_string(proc->body), tcl_length(proc->body) + 1, proc);
+    tcl_register(tcl, name, tcl_user_proc, 0, proc, tcl_proc_free);
 }
 
-static tcl_result_t tcl_cmd_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)arg;
-    tcl_value_t *name = tcl_list_at(args, 1);
-    tcl_register(tcl, tcl_string(name), tcl_user_proc, 0, tcl_dup(args));
-    tcl_free(name);
+static tcl_result_t tcl_cmd_proc(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    tcl_define(tcl, tcl_string(argv[1]), tcl_dup(argv[2]), tcl_dup(argv[3]));
     return tcl_result(tcl, TCL_OK, tcl_alloc("", 0));
 }
 
-static tcl_result_t tcl_cmd_if(struct tcl *tcl, tcl_value_t *args, void *arg) {
+/* The arg of a command copied from a shared interpreter stays its owner's */
+static void tcl_borrowed(void *arg) { (void)arg; }
+
+/* Copies a command of the shared interpreter into this one on its first
+ * use, so the shared one is only ever read. Procs are compiled again from
+ * their text, as running code writes to it (reference counts, call site
+ * caches). */
+static struct tcl_cmd *tcl_adopt(struct tcl *tcl, const struct tcl_cmd *cmd) {
+    if (cmd->fn == tcl_user_proc) {
+        struct tcl_proc *proc = (struct tcl_proc *)cmd->arg;
+        tcl_define(tcl, cmd->name->str, tcl_alloc(proc->params->str, proc->params->len),
+                   tcl_alloc(proc->body->str, proc->body->len));
+    } else {
+        tcl_register(tcl, cmd->name->str, cmd->fn, cmd->arity, cmd->arg, tcl_borrowed);
+    }
+    return tcl_find(tcl, cmd->name->str, cmd->name->len);
+}
+
+/* Evaluates an if or while condition, compiled to code if it is a script */
+static tcl_result_t tcl_test(struct tcl *tcl, tcl_value_t *cond, struct tcl_code *code) {
+    if (tcl_is_expr(tcl_string(cond), tcl_length(cond))) {
+        return tcl_expr(tcl, cond);
+    }
+    return tcl_run(tcl, code, cond);
+}
+
+static tcl_result_t tcl_cmd_if(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
     int i = 1;
-    int n = tcl_list_length(args);
     tcl_result_t r = TCL_OK;
-    while (i < n) {
-        tcl_value_t *cond = tcl_list_at(args, i);
-        tcl_value_t *branch = NULL;
-        if (i + 1 < n) {
-            branch = tcl_list_at(args, i + 1);
-        }
-        r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
-        tcl_free(cond);
+    while (i < argc) {
+        tcl_value_t *cond = argv[i];
+        if (i + 1 == argc) {
+            /* Trailing "other" branch */
+            r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
+            break;
+        }
+        tcl_value_t *branch = argv[i + 1];
+        r = tcl_test(tcl, cond, NULL);
         if (r != TCL_OK) {
-            tcl_free(branch);
             break;
         }
-        if (tcl_num(tcl->result) > 0) {
+        if (tcl_true(tcl->result)) {
             r = tcl_eval(tcl, tcl_string(branch), tcl_length(branch) + 1);
-            tcl_free(branch);
             break;
         }
         i = i + 2;
-        tcl_free(branch);
     }
     return r;
 }
 
-static tcl_result_t tcl_cmd_flow(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static tcl_result_t tcl_cmd_flow(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
     (void)arg;
     tcl_result_t r = TCL_ERROR;
-    tcl_value_t *flowval = tcl_list_at(args, 0);
-    const char *flow = tcl_string(flowval);
+    const char *flow = tcl_string(argv[0]);
     if (strcmp(flow, "break") == 0) {
         r = TCL_BREAK;
     } else if (strcmp(flow, "continue") == 0) {
         r = TCL_AGAIN;
     } else if (strcmp(flow, "return") == 0) {
-        r = tcl_result(tcl, TCL_RETURN, tcl_list_at(args, 1));
+        r = tcl_result(tcl, TCL_RETURN, argc > 1 ? tcl_dup(argv[1]) : tcl_alloc("", 0));
     }
-    tcl_free(flowval);
     return r;
 }
 
-static tcl_result_t tcl_cmd_while(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)arg;
-    tcl_value_t *cond = tcl_list_at(args, 1);
-    tcl_value_t *loop = tcl_list_at(args, 2);
+static tcl_result_t tcl_cmd_while(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)arg, (void)argc;
+    tcl_value_t *cond = argv[1];
+    tcl_value_t *loop = argv[2];
+    /* Compiled once here instead of re-lexed on every iteration */
+    struct tcl_code *ccode = NULL;
+    if (!tcl_is_expr(tcl_string(cond), tcl_length(cond))) {
+        ccode = tcl_compile(tcl, tcl_string(cond), tcl_length(cond) + 1);
+    }
+    struct tcl_code *lcode = tcl_compile(tcl, tcl_string(loop), tcl_length(loop) + 1);
     tcl_result_t r;
     for (;;) {
-        r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
-        if (r != TCL_OK) {
-            tcl_free(cond);
-            tcl_free(loop);
-            return r;
+        r = tcl_test(tcl, cond, ccode);
+        if (r != TCL_OK || !tcl_true(tcl->result)) {
+            break;
         }
-        if (tcl_num(tcl->result) == 0) {
-            tcl_free(cond);
-            tcl_free(loop);
-            return TCL_OK;
+#if TCL_TRACE
+        tcl_trace(tcl, 'B', 'l', "while", argv);
+#endif
+        r = tcl_run(tcl, lcode, loop);
+#if TCL_TRACE
+        tcl_trace(tcl, 'E', 'l', "while", NULL);
+#endif
+        if (r == TCL_BREAK) {
+            r = TCL_OK;
+            break;
         }
-        int r = tcl_eval(tcl, tcl_string(loop), tcl_length(loop) + 1);
-        switch (r) {
-            case TCL_BREAK:
-                tcl_free(cond);
-                tcl_free(loop);
-                return TCL_OK;
-            case TCL_RETURN:
-            case TCL_ERROR:
-                tcl_free(cond);
-                tcl_free(loop);
-                return r;
-            case TCL_AGAIN:
-                continue;
+        if (r == TCL_RETURN || r == TCL_ERROR) {
+            break;
         }
     }
+    tcl_code_free(ccode);
+    tcl_code_free(lcode);
+    return r;
 }
 
-static tcl_result_t tcl_cmd_comment(struct tcl *tcl, tcl_value_t *args, void *arg) {
-    (void)tcl, (void)arg, (void)args;
+static tcl_result_t tcl_cmd_comment(struct tcl *tcl, int argc, tcl_value_t **argv, void *arg) {
+    (void)tcl, (void)argc, (void)argv, (void)arg;
+    return TCL_OK;
 }
 
+static void tcl_after_free(struct tcl *tcl);
+static void tcl_chans_free(struct tcl *tcl);
+static void tcl_watch_free(struct tcl *tcl);
+
 void tcl_destroy(struct tcl *tcl) {
+    tcl_after_free(tcl);
+    tcl_chans_free(tcl);
+    tcl_watch_free(tcl);
     while (tcl->env) {
-        tcl->env = tcl_env_free(tcl->env);
+        tcl_env_pop(tcl);
+    }
+    while (tcl->frames) {
+        struct tcl_env *env = tcl->frames;
+        tcl->frames = env->parent;
+        tcl_mfree(env->slots);
+        tcl_mfree(env);
     }
-    while (tcl->cmds) {
-        struct tcl_cmd *cmd = tcl->cmds;
-        tcl->cmds = tcl->cmds->next;
-        tcl_free(cmd->name);
-        free(cmd->arg);
-        free(cmd);
+    for (int i = 0; i < tcl->cmdslen; i++) {
+        while (tcl->cmds[i] != NULL) {
+            struct tcl_cmd *cmd = tcl->cmds[i];
+            tcl->cmds[i] = cmd->next;
+            tcl_free(cmd->name);
+            tcl_cmd_release(cmd);
+            tcl_mfree(cmd);
+        }
     }
+    tcl_mfree(tcl->cmds);
     tcl_free(tcl->result);
+    tcl_mfree(tcl->stack);
+    tcl_mfree(tcl->calls);
+    tcl_mfree(tcl->arena);
+#if TCL_ACCOUNT
+    if (tcl_heap == &tcl->heap) {
+        tcl_heap = NULL;
+    }
+#endif
 }
 
 #include "tcl_math.h"
+#include "tcl_expr.h"
+#include "tcl_binary.h"
+#include "tcl_info.h"
+#include "tcl_after.h"
 #include "tcl_streams.h"
 #include "tcl_arduino.h"
 
-void tcl_init(struct tcl *tcl) {
-    tcl->env = tcl_env_alloc(NULL);
+/* Everything but the commands */
+static void tcl_setup(struct tcl *tcl, tcl_alloc_fn_t alloc, void *ctx) {
+#if TCL_ACCOUNT
+    memset(&tcl->heap, 0, sizeof(tcl->heap));
+    tcl->heap.alloc = (alloc != NULL ? alloc : tcl_system_alloc);
+    tcl->heap.ctx = ctx;
+    tcl_heap = &tcl->heap;
+#else
+    (void)alloc, (void)ctx;
+#endif
+    tcl->env = NULL;
+    tcl->frames = NULL;
+    tcl_env_push(tcl, NULL);
     tcl->result = tcl_alloc("", 0);
     tcl->cmds = NULL;
+    tcl->ncmds = tcl->cmdslen = 0;
+    tcl->shared = NULL;
+    tcl->epoch = 1;
+    tcl->stack = NULL;
+    tcl->sp = tcl->stacklen = 0;
+    tcl->calls = NULL;
+    tcl->ncalls = tcl->callslen = 0;
+    tcl->nest = 0;
+    tcl->compile = TCL_COMPILE;
+    tcl->arena = (TCL_ARENA > 0 ? (char *)tcl_malloc(TCL_ARENA) : NULL);
+    tcl->arenatop = 0;
+    tcl->wheel = NULL;
+    tcl->chans = NULL;
+    tcl->nchans = 0;
+#if TCL_PROFILE
+    tcl->callees = 0;
+#endif
+#if TCL_TRACE
+    memset(&tcl->trace, 0, sizeof(tcl->trace));
+#endif
+}
+
+/* Sets up an interpreter, taking its memory from alloc if given */
+void tcl_init(struct tcl *tcl, tcl_alloc_fn_t alloc = NULL, void *ctx = NULL) {
+    tcl_setup(tcl, alloc, ctx);
     tcl_register(tcl, "set", tcl_cmd_set, 0);
     tcl_register(tcl, "subst", tcl_cmd_subst, 2);
+    tcl_register(tcl, "append", tcl_cmd_append, 0);
     tcl_register(tcl, "proc", tcl_cmd_proc, 4);
     tcl_register(tcl, "if", tcl_cmd_if, 0);
     tcl_register(tcl, "while", tcl_cmd_while, 3);
@@ -542,8 +2492,26 @@ void tcl_init(struct tcl *tcl) {
     tcl_register(tcl, "continue", tcl_cmd_flow, 1);
     tcl_register(tcl, "#", tcl_cmd_comment, 0);
     tcl_init_math(tcl);
+    tcl_init_expr(tcl);
+    tcl_init_binary(tcl);
+    tcl_init_info(tcl);
+    tcl_init_after(tcl);
     tcl_init_streams(tcl);
     tcl_init_arduino(tcl);
 }
 
+/* Sets up an interpreter with no commands of its own: it uses those of
+ * shared, builtins, procs and host commands alike, copying each on first
+ * call. Nothing in shared is written, so any number of interpreters on
+ * any number of threads can share it, as long as shared itself is left
+ * alone meanwhile. Variables and results are never shared. */
+void tcl_init_shared(struct tcl *tcl, const struct tcl *shared, tcl_alloc_fn_t alloc = NULL, void *ctx = NULL) {
+    tcl_setup(tcl, alloc, ctx);
+    tcl->shared = shared;
+}
+
+#if TCL_POOL
+#include "tcl_pool.h"
+#endif
+
 #endif
\ No newline at end of file